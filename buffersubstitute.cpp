@@ -0,0 +1,131 @@
+#include "buffersubstitute.h"
+
+#include <QRegExp>
+#include <QSet>
+#include <QStringList>
+#include <QTextCursor>
+#include <QTextDocument>
+#include <QtConcurrentMap>
+
+SubstituteScanner::SubstituteScanner(const QString& needle,
+                                     const QString& replacement,
+                                     const QString& flags)
+  : needle(needle), replacement(replacement),
+    global(flags.contains(QLatin1Char('g'))),
+    caseSensitivity(flags.contains(QLatin1Char('i'))
+                    ? Qt::CaseInsensitive : Qt::CaseSensitive)
+{
+}
+
+// Matches never span lines, so ^ and $ anchor at the start and the end
+// of every line. & and \0 in the replacement stand for the match, \1 to
+// \9 for its captures, and \& for a plain &. :s uses this, too.
+QList<SubstituteEdit> SubstituteScanner::operator()(const QString& text) const
+{
+  // QRegExp caches its last match, so every thread needs its own
+  QRegExp pattern(needle, caseSensitivity);
+  QList<SubstituteEdit> edits;
+  int lineStart = 0;
+  while (lineStart <= text.size()) {
+    int lineEnd = text.indexOf(QLatin1Char('\n'), lineStart);
+    if (lineEnd == -1) {
+      lineEnd = text.size();
+    }
+    const QString line = text.mid(lineStart, lineEnd - lineStart);
+    int from = 0;
+    while (from <= line.size()) {
+      const int i = pattern.indexIn(line, from, QRegExp::CaretAtZero);
+      if (i == -1) {
+        break;
+      }
+      SubstituteEdit edit;
+      edit.position = lineStart + i;
+      edit.length = pattern.matchedLength();
+      const QStringList captures = pattern.capturedTexts();
+      for (int j = 0, n = replacement.size(); j != n; ++j) {
+        const QChar c = replacement.at(j);
+        if (c == QLatin1Char('\\') && j + 1 != n) {
+          const QChar next = replacement.at(++j);
+          if (next.isDigit()) {
+            edit.text += captures.value(next.digitValue());
+          } else {
+            edit.text += next;
+          }
+        } else if (c == QLatin1Char('&')) {
+          edit.text += captures.at(0);
+        } else {
+          edit.text += c;
+        }
+      }
+      edits.append(edit);
+      if (!global) {
+        break;
+      }
+      // an empty match must not be found again
+      from = i + qMax(edit.length, 1);
+    }
+    lineStart = lineEnd + 1;
+  }
+  return edits;
+}
+
+BufferSubstitute::BufferSubstitute(const QList<QTextDocument*>& documents,
+                                   QObject* parent)
+  : QObject(parent)
+{
+  // split views share their document, it is substituted in once
+  QSet<QTextDocument*> seen;
+  foreach (QTextDocument* document, documents) {
+    if (!seen.contains(document)) {
+      seen.insert(document);
+      this->documents.append(document);
+    }
+  }
+  connect(&watcher, SIGNAL(finished()), SLOT(apply()));
+}
+
+void BufferSubstitute::start(const QString& needle, const QString& replacement,
+                             const QString& flags)
+{
+  // QString is implicitly shared, so the snapshots are cheap to take and
+  // stay untouched however the documents change in the meantime
+  QStringList snapshots;
+  foreach (QTextDocument* document, documents) {
+    snapshots.append(document->toPlainText());
+    revisions.append(document->revision());
+  }
+  watcher.setFuture(QtConcurrent::mapped(snapshots,
+      SubstituteScanner(needle, replacement, flags)));
+}
+
+void BufferSubstitute::apply()
+{
+  int substitutions = 0;
+  int changed = 0;
+  int skipped = 0;
+  for (int i = 0; i != documents.size(); ++i) {
+    QTextDocument* document = documents.at(i);
+    const QList<SubstituteEdit> edits = watcher.resultAt(i);
+    if (edits.isEmpty()) {
+      continue;
+    }
+    if (!document || document->revision() != revisions.at(i)) {
+      ++skipped;
+      continue;
+    }
+    // back to front, so the positions of the edits still to come hold
+    QTextCursor cursor(document);
+    cursor.beginEditBlock();
+    for (int j = edits.size() - 1; j >= 0; --j) {
+      const SubstituteEdit& edit = edits.at(j);
+      cursor.setPosition(edit.position);
+      cursor.setPosition(edit.position + edit.length, QTextCursor::KeepAnchor);
+      cursor.insertText(edit.text);
+    }
+    cursor.endEditBlock();
+    substitutions += edits.size();
+    ++changed;
+  }
+  emit finished(substitutions, changed, skipped);
+  deleteLater();
+}
@@ -0,0 +1,63 @@
+#ifndef BUFFERSUBSTITUTE_H
+#define BUFFERSUBSTITUTE_H
+
+#include <QFutureWatcher>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+
+class QTextDocument;
+
+// One replacement, found in a snapshot of a document's text.
+struct SubstituteEdit
+{
+  int position;
+  int length;
+  QString text;
+};
+
+// Finds the edits of a substitute in one snapshot, for :s and :bufdo.
+// Only works on the string it is given, so it can run in any thread.
+class SubstituteScanner
+{
+public:
+  typedef QList<SubstituteEdit> result_type;
+
+  SubstituteScanner(const QString& needle, const QString& replacement,
+                    const QString& flags);
+  QList<SubstituteEdit> operator()(const QString& text) const;
+
+private:
+  QString needle;
+  QString replacement;
+  bool global;
+  Qt::CaseSensitivity caseSensitivity;
+};
+
+// Runs an ex style substitute over many documents. The documents are
+// scanned in parallel on immutable snapshots of their text, then the
+// edits are applied on the GUI thread, one undo step per document. A
+// document that changed while it was scanned is left alone.
+class BufferSubstitute : public QObject
+{
+  Q_OBJECT
+
+public:
+  BufferSubstitute(const QList<QTextDocument*>& documents, QObject* parent = 0);
+  void start(const QString& needle, const QString& replacement,
+             const QString& flags);
+
+signals:
+  void finished(int substitutions, int changedDocuments, int skippedDocuments);
+
+private slots:
+  void apply();
+
+private:
+  QList<QPointer<QTextDocument> > documents;
+  QList<int> revisions;
+  QFutureWatcher<QList<SubstituteEdit> > watcher;
+};
+
+#endif
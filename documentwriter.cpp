@@ -0,0 +1,201 @@
+#include "documentwriter.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryFile>
+#include <QTextBlock>
+#include <QTextStream>
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#include <windows.h>
+#else
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static bool syncFile(int handle)
+{
+#ifdef Q_OS_WIN
+  return _commit(handle) == 0;
+#else
+  return fsync(handle) == 0;
+#endif
+}
+
+// QFile::rename() refuses to overwrite, so go to the platform for an
+// atomic replace.
+static bool replaceFile(const QString& from, const QString& to)
+{
+#ifdef Q_OS_WIN
+  return MoveFileExW(reinterpret_cast<const wchar_t*>(from.utf16()),
+                     reinterpret_cast<const wchar_t*>(to.utf16()),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  return rename(QFile::encodeName(from).constData(),
+                QFile::encodeName(to).constData()) == 0;
+#endif
+}
+
+// What a new file gets when it is created in place: readable by all and
+// writable by the owner, less what the umask takes away.
+static QFile::Permissions defaultPermissions()
+{
+  QFile::Permissions permissions = QFile::ReadOwner | QFile::WriteOwner
+      | QFile::ReadUser | QFile::WriteUser | QFile::ReadGroup
+      | QFile::ReadOther;
+#ifndef Q_OS_WIN
+  // umask() can only be read by setting it
+  const mode_t mask = umask(0);
+  umask(mask);
+  if (mask & S_IRUSR) {
+    permissions &= ~(QFile::ReadOwner | QFile::ReadUser);
+  }
+  if (mask & S_IWUSR) {
+    permissions &= ~(QFile::WriteOwner | QFile::WriteUser);
+  }
+  if (mask & S_IRGRP) {
+    permissions &= ~QFile::ReadGroup;
+  }
+  if (mask & S_IROTH) {
+    permissions &= ~QFile::ReadOther;
+  }
+#endif
+  return permissions;
+}
+
+static QString systemError()
+{
+  return QString::fromLocal8Bit(strerror(errno));
+}
+
+// A symlink is written through, so the link stays and its target gets the
+// text, as when the file is saved in place.
+DocumentWriter::DocumentWriter(const QString& fileName)
+  : fileName(fileName), lineCount(0), byteCount(0)
+{
+  QFileInfo info(fileName);
+  if (info.isSymLink()) {
+    // a dangling link has no canonical path, but can still be written
+    const QString target = info.canonicalFilePath();
+    this->fileName = target.isEmpty() ? info.symLinkTarget() : target;
+  }
+}
+
+// Opens the temporary file next to the target, with the target's
+// permissions from the start, so the text is never readable by more
+// users than the target allows. QTemporaryFile creates the file for the
+// owner only, so a new target gets the default permissions under the
+// umask instead, like a file written in place.
+bool DocumentWriter::open(QTemporaryFile& file)
+{
+  QFileInfo info(fileName);
+  file.setFileTemplate(info.absolutePath() + "/." + info.fileName()
+                       + ".XXXXXX");
+  if (!file.open()) {
+    error = file.errorString();
+    return false;
+  }
+  const QFile::Permissions permissions = info.exists()
+      ? QFile::permissions(fileName) : defaultPermissions();
+  if (!file.setPermissions(permissions)) {
+    error = file.errorString();
+    return false;
+  }
+  return true;
+}
+
+bool DocumentWriter::write(const QTextBlock& first, const QTextBlock& last)
+{
+  lineCount = 0;
+  byteCount = 0;
+  error.clear();
+
+  QTemporaryFile file;
+  if (!open(file)) {
+    return false;
+  }
+
+  QTextStream stream(&file);
+  for (QTextBlock block = first; block.isValid(); block = block.next()) {
+    stream << block.text();
+    // the last block of a document has no line break
+    if (block.next().isValid()) {
+      stream << '\n';
+      ++lineCount;
+    }
+    if (block == last) {
+      break;
+    }
+  }
+  stream.flush();
+
+  if (stream.status() != QTextStream::Ok) {
+    error = file.errorString();
+    return false;
+  }
+  return commit(file);
+}
+
+bool DocumentWriter::write(const QByteArray& data)
+{
+  lineCount = data.count('\n');
+  byteCount = 0;
+  error.clear();
+
+  QTemporaryFile file;
+  if (!open(file)) {
+    return false;
+  }
+  if (file.write(data) != data.size()) {
+    error = file.errorString();
+    return false;
+  }
+  return commit(file);
+}
+
+// Syncs the written temporary file and renames it over the target.
+bool DocumentWriter::commit(QTemporaryFile& file)
+{
+  if (!file.flush()) {
+    error = file.errorString();
+    return false;
+  }
+  if (!syncFile(file.handle())) {
+    error = systemError();
+    return false;
+  }
+  byteCount = file.size();
+
+  const QString tempName = file.fileName();
+  file.close();
+  if (!replaceFile(tempName, QFileInfo(fileName).absoluteFilePath())) {
+#ifdef Q_OS_WIN
+    error = QString("Cannot replace '%1'").arg(fileName);
+#else
+    error = QString("Cannot replace '%1': %2").arg(fileName, systemError());
+#endif
+    return false;
+  }
+  file.setAutoRemove(false);
+  return true;
+}
+
+QString DocumentWriter::errorString() const
+{
+  return error;
+}
+
+int DocumentWriter::lines() const
+{
+  return lineCount;
+}
+
+qint64 DocumentWriter::bytes() const
+{
+  return byteCount;
+}
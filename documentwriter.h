@@ -0,0 +1,35 @@
+#ifndef DOCUMENTWRITER_H
+#define DOCUMENTWRITER_H
+
+#include <QString>
+
+class QByteArray;
+class QTemporaryFile;
+class QTextBlock;
+
+// Saves a range of blocks of a QTextDocument. The text is streamed block
+// by block into a temporary file next to the target, which is synced and
+// then renamed over the target, so the target is never missing or half
+// written. Line and byte counts are collected on the way.
+class DocumentWriter
+{
+public:
+  DocumentWriter(const QString& fileName);
+  bool write(const QTextBlock& first, const QTextBlock& last);
+  // Replaces the target with data the same way.
+  bool write(const QByteArray& data);
+  QString errorString() const;
+  int lines() const;
+  qint64 bytes() const;
+
+private:
+  bool open(QTemporaryFile& file);
+  bool commit(QTemporaryFile& file);
+
+  QString fileName;
+  QString error;
+  int lineCount;
+  qint64 byteCount;
+};
+
+#endif
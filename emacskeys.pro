@@ -14,19 +14,33 @@ include(../../shared/indenter/indenter.pri)
 QT += gui
 
 SOURCES += \
+    buffersubstitute.cpp \
+    documentwriter.cpp \
     emacskeysactions.cpp \
     emacskeyshandler.cpp \
     emacskeysplugin.cpp \
+    fileinserter.cpp \
     killring.cpp \
-    markring.cpp
+    markring.cpp \
+    minibuffer.cpp \
+    registers.cpp \
+    undotree.cpp \
+    wordindex.cpp
 
 HEADERS += \
+    buffersubstitute.h \
+    documentwriter.h \
     emacskeysactions.h \
     emacskeyshandler.h \
     emacskeysplugin.h \
+    fileinserter.h \
     mark.h \
     markring.h \
+    minibuffer.h \
     killring.h \
+    registers.h \
+    undotree.h \
+    wordindex.h
 
 
 FORMS += \
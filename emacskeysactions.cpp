@@ -47,7 +47,9 @@ namespace EmacsKeys {
 namespace Internal {
 
 EmacsKeysSettings::EmacsKeysSettings()
-{}
+{
+    m_config = EmacsKeysConfig();
+}
 
 EmacsKeysSettings::~EmacsKeysSettings()
 {
@@ -59,6 +61,8 @@ void EmacsKeysSettings::insertItem(int code, SavedAction *item,
 {
     QTC_ASSERT(!m_items.contains(code), qDebug() << code << item->toString(); return);
     m_items[code] = item;
+    m_itemToCode[item] = code;
+    connect(item, SIGNAL(valueChanged(QVariant)), this, SLOT(settingChanged()));
     if (!longName.isEmpty()) {
         m_nameToCode[longName] = code;
         m_codeToName[code] = longName;
@@ -70,6 +74,7 @@ void EmacsKeysSettings::insertItem(int code, SavedAction *item,
 
 void EmacsKeysSettings::readSettings(QSettings *settings)
 {
+    // every changed item refreshes its field of the config
     foreach (SavedAction *item, m_items)
         item->readSettings(settings);
 }
@@ -91,6 +96,69 @@ SavedAction *EmacsKeysSettings::item(const QString &name)
     return m_items.value(m_nameToCode.value(name, -1), 0);
 }
 
+// Builds the whole config, once all items are inserted.
+void EmacsKeysSettings::updateConfig()
+{
+    foreach (int code, m_items.keys())
+        updateConfig(code);
+}
+
+void EmacsKeysSettings::settingChanged()
+{
+    SavedAction *item = qobject_cast<SavedAction *>(sender());
+    if (m_itemToCode.contains(item))
+        updateConfig(m_itemToCode.value(item));
+}
+
+void EmacsKeysSettings::updateConfig(int code)
+{
+    const QVariant value = m_items.value(code)->value();
+    switch (code) {
+    case ConfigUseEmacsKeys:
+        m_config.useEmacsKeys = value.toBool();
+        break;
+    case ConfigStartOfLine:
+        m_config.startOfLine = value.toBool();
+        break;
+    case ConfigHlSearch:
+        m_config.hlSearch = value.toBool();
+        break;
+    case ConfigTabStop:
+        m_config.tabStop = value.toInt();
+        break;
+    case ConfigSmartTab:
+        m_config.smartTab = value.toBool();
+        break;
+    case ConfigShiftWidth:
+        m_config.shiftWidth = value.toInt();
+        break;
+    case ConfigExpandTab:
+        m_config.expandTab = value.toBool();
+        break;
+    case ConfigAutoIndent:
+        m_config.autoIndent = value.toBool();
+        break;
+    case ConfigIncSearch:
+        m_config.incSearch = value.toBool();
+        break;
+    case ConfigCompletionDelay:
+        m_config.completionDelay = value.toInt();
+        break;
+    case ConfigPersistRegisters:
+        m_config.persistRegisters = value.toBool();
+        break;
+    case ConfigBackspace: {
+        const QString backspace = value.toString();
+        m_config.backspaceIndent = backspace.contains(QLatin1String("indent"));
+        m_config.backspaceEol = backspace.contains(QLatin1String("eol"));
+        m_config.backspaceStart = backspace.contains(QLatin1String("start"));
+        break;
+    }
+    default:
+        break;
+    }
+}
+
 EmacsKeysSettings *theEmacsKeysSettings()
 {
     static EmacsKeysSettings *instance = 0;
@@ -153,6 +221,17 @@ EmacsKeysSettings *theEmacsKeysSettings()
     item->setCheckable(true);
     instance->insertItem(ConfigIncSearch, item, QLatin1String("incsearch"), QLatin1String("is"));
 
+    item = new SavedAction(instance);
+    item->setDefaultValue(200);
+    item->setSettingsKey(group, QLatin1String("CompletionDelay"));
+    instance->insertItem(ConfigCompletionDelay, item, QLatin1String("completiondelay"), QLatin1String("cd"));
+
+    item = new SavedAction(instance);
+    item->setDefaultValue(false);
+    item->setSettingsKey(group, QLatin1String("PersistRegisters"));
+    item->setCheckable(true);
+    instance->insertItem(ConfigPersistRegisters, item, QLatin1String("persistregisters"), QLatin1String("pr"));
+
     item = new SavedAction(instance);
     item->setDefaultValue(QLatin1String("indent,eol,start"));
     item->setSettingsKey(group, QLatin1String("Backspace"));
@@ -162,6 +241,7 @@ EmacsKeysSettings *theEmacsKeysSettings()
     item->setText(QCoreApplication::translate("EmacsKeys::Internal", "EmacsKeys properties..."));
     instance->insertItem(SettingsDialog, item);
 
+    instance->updateConfig();
     return instance;
 }
 
@@ -170,5 +250,10 @@ SavedAction *theEmacsKeysSetting(int code)
     return theEmacsKeysSettings()->item(code);
 }
 
+const EmacsKeysConfig &theEmacsKeysConfig()
+{
+    return theEmacsKeysSettings()->config();
+}
+
 } // namespace Internal
 } // namespace EmacsKeys
@@ -37,6 +37,8 @@ enum EmacsKeysSettingsCode
     ConfigExpandTab,
     ConfigAutoIndent,
     ConfigIncSearch,
+    ConfigCompletionDelay, // idle milliseconds before completion pops up
+    ConfigPersistRegisters, // keep the C-x r registers across sessions
 
     // indent  allow backspacing over autoindent
     // eol     allow backspacing over line breaks (join lines)
@@ -48,8 +50,31 @@ enum EmacsKeysSettingsCode
     SettingsDialog,
 };
 
+// Typed copy of the settings for code that runs on every event. It is
+// built once all settings exist, after that a change only refreshes its
+// own field.
+struct EmacsKeysConfig
+{
+    bool useEmacsKeys;
+    bool startOfLine;
+    bool hlSearch;
+    int tabStop;
+    bool smartTab;
+    int shiftWidth;
+    bool expandTab;
+    bool autoIndent;
+    bool incSearch;
+    int completionDelay;
+    bool persistRegisters;
+    bool backspaceIndent;
+    bool backspaceEol;
+    bool backspaceStart;
+};
+
 class EmacsKeysSettings : public QObject
 {
+    Q_OBJECT
+
 public:
     EmacsKeysSettings();
     ~EmacsKeysSettings();
@@ -63,14 +88,26 @@ public:
     void readSettings(QSettings *settings);
     void writeSettings(QSettings *settings);
 
+    const EmacsKeysConfig &config() const { return m_config; }
+
+    void updateConfig();
+
+private slots:
+    void settingChanged();
+
 private:
+    void updateConfig(int code);
+
+    EmacsKeysConfig m_config;
     QHash<int, Core::Utils::SavedAction *> m_items; 
+    QHash<Core::Utils::SavedAction *, int> m_itemToCode;
     QHash<QString, int> m_nameToCode; 
     QHash<int, QString> m_codeToName; 
 };
 
 EmacsKeysSettings *theEmacsKeysSettings();
 Core::Utils::SavedAction *theEmacsKeysSetting(int code);
+const EmacsKeysConfig &theEmacsKeysConfig();
 
 } // namespace Internal
 } // namespace EmacsKeys
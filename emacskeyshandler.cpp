@@ -45,6 +45,7 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QObject>
 #include <QtCore/QPointer>
 #include <QtCore/QProcess>
@@ -52,10 +53,14 @@
 #include <QtCore/QTextStream>
 #include <QtCore/QtAlgorithms>
 #include <QtCore/QStack>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
 
 #include <QtGui/QApplication>
+#include <QtGui/QFontMetrics>
 #include <QtGui/QKeyEvent>
 #include <QtGui/QLineEdit>
+#include <QtGui/QPainter>
 #include <QtGui/QPlainTextEdit>
 #include <QtGui/QScrollBar>
 #include <QtGui/QTextBlock>
@@ -64,7 +69,13 @@
 #include <QtGui/QTextEdit>
 #include <QtGui/QClipboard>
 
+#include "buffersubstitute.h"
+#include "documentwriter.h"
+#include "fileinserter.h"
 #include "markring.h"
+#include "registers.h"
+#include "undotree.h"
+#include "wordindex.h"
 #include "killring.h"
 
 #define DEBUG_KEY  1
@@ -118,6 +129,12 @@ enum Mode
     ExMode,
     SearchForwardMode,
     SearchBackwardMode,
+    GotoLineMode,
+    QueryReplaceFromMode,   // reading what M-% replaces
+    QueryReplaceToMode,     // reading what it is replaced with
+    QueryReplaceMode,       // asking about each match
+    StringRectangleMode,    // reading the string of C-x r t
+    UndoTreeMode,           // moving around in the undo tree, C-x u
 };
 
 enum SubMode
@@ -156,6 +173,69 @@ enum VisualMode
     VisualBlockMode,
 };
 
+enum JumpState
+{
+    NoJump,
+    JumpReadChars,      // collecting the characters to jump to
+    JumpReadLabel,      // collecting the label of the target
+};
+
+enum CharCommand
+{
+    // commands that read one more character before they run
+    NoCharCommand,
+    ZapToCharCommand,           // M-z
+    CharSearchForwardCommand,   // C-c f
+    CharSearchBackwardCommand,  // C-c b
+    CopyToRegisterCommand,      // C-x r s
+    InsertRegisterCommand,      // C-x r i
+    PointToRegisterCommand,     // C-x r SPC
+    JumpToRegisterCommand,      // C-x r j
+    NumberToRegisterCommand,    // C-x r n
+    IncrementRegisterCommand,   // C-x r +
+};
+
+// Runs of these commands are undone together, like in Emacs.
+enum UndoAmalgamation
+{
+    NoAmalgamation,
+    AmalgamateInsert,       // self-inserted characters
+    AmalgamateDelete,       // C-d and Delete
+    AmalgamateBackspace,    // Backspace
+};
+
+enum ArgumentState
+{
+    NoArgument,
+    ArgumentMultiplied, // C-u typed, every further C-u multiplies by 4
+    ArgumentDigits,     // digits typed after C-u
+};
+
+// One step of a keyboard macro. Runs of self-inserted letters, digits
+// and spaces are stored as one text step and inserted at once on
+// playback, C-x commands by name and everything else as the key.
+// Characters the editor may treat specially, like braces it indents for
+// or parentheses it closes, are keys, so playback goes through the editor
+// again. So are Backspace and Delete, which the editor may make unindent
+// or remove a closing parenthesis, too.
+struct MacroStep
+{
+    enum Kind { Key, Text, Command };
+    Kind kind;
+    int key;
+    int modifiers;
+    QString text;
+};
+
+// A match of query-replace, at its position in the document before
+// anything was replaced.
+struct QueryReplaceMatch
+{
+    int position;
+    int length;
+    QStringList captures; // \& and \1 to \9 of query-replace-regexp
+};
+
 enum MoveType
 {
     MoveExclusive,
@@ -183,6 +263,114 @@ QString quoteUnprintable(const QString &ba)
     return res;
 }
 
+// Line and column metrics of the visible part of the editor. Everything
+// is derived from the font and the viewport size, so answering "where on
+// screen is the cursor" does not need a cursorRect() layout query.
+struct ScreenGeometry
+{
+    ScreenGeometry()
+        : valid(false), lineHeight(1), charWidth(1), lines(1), columns(1)
+    {}
+    bool valid;
+    int lineHeight;
+    int charWidth;
+    int lines;
+    int columns;
+};
+
+// Which characters occur in a block. Letters are stored lower case and
+// everything outside of ASCII shares a single bit, so this only tells
+// whether a block is worth scanning when looking for jump targets.
+struct CharBitmap
+{
+    CharBitmap() : revision(-1), length(-1), other(false)
+        { bits[0] = bits[1] = 0; }
+    void add(ushort c)
+    {
+        if (c < 128)
+            bits[c >> 6] |= Q_UINT64_C(1) << (c & 63);
+        else
+            other = true;
+    }
+    bool mayContain(ushort c) const
+        { return c < 128 ? ((bits[c >> 6] >> (c & 63)) & 1) : other; }
+
+    int revision; // QTextBlock::revision() the bitmap was built from
+    int length;
+    quint64 bits[2];
+    bool other;
+};
+
+// Paints the jump labels on top of the editor's viewport.
+class JumpLabelOverlay : public QWidget
+{
+public:
+    JumpLabelOverlay(QWidget *parent) : QWidget(parent)
+    {
+        setAttribute(Qt::WA_TransparentForMouseEvents);
+        setGeometry(parent->rect());
+    }
+
+    void setLabels(const QList<QRect> &rects, const QStringList &labels)
+    {
+        m_rects = rects;
+        m_labels = labels;
+        update();
+    }
+
+protected:
+    void paintEvent(QPaintEvent *)
+    {
+        QPainter painter(this);
+        const QFontMetrics fm(font());
+        for (int i = 0; i != m_rects.size(); ++i) {
+            QRect rect = m_rects.at(i);
+            rect.setWidth(fm.width(m_labels.at(i)));
+            painter.fillRect(rect, QColor(255, 255, 0));
+            painter.setPen(Qt::red);
+            painter.drawText(rect, Qt::AlignLeft | Qt::AlignVCenter, m_labels.at(i));
+        }
+    }
+
+private:
+    QList<QRect> m_rects;
+    QStringList m_labels;
+};
+
+struct ExCommandInfo;
+
+// An ex command line "[range]name[!] [args]" split into its parts.
+struct ExCommand
+{
+    QString line;
+    int beginLine; // 1 based, -1 if not given
+    int endLine;
+    QString name;
+    bool bang;
+    QString args;
+    const ExCommandInfo *info; // 0 if the name is unknown
+    int flags; // ExCommandFlags of the matched command
+};
+
+enum ExCommandFlags
+{
+    ExQuit = 1,
+    ExQuitAll = 2,
+    ExReplace = 4,
+};
+
+typedef void (EmacsKeysHandler::Private::*ExCommandHandler)(const ExCommand &);
+
+struct ExCommandInfo
+{
+    const char *name;
+    int minLength; // shortest accepted abbreviation
+    ExCommandHandler handler;
+    int flags;
+};
+
+static const ExCommandInfo *findExCommand(const QString &name);
+
 enum EventResult
 {
     EventHandled,
@@ -196,11 +384,13 @@ public:
     Private(EmacsKeysHandler *parent, QWidget *widget);
 
     EventResult handleEvent(QKeyEvent *ev);
+    EventResult dispatchKey(QKeyEvent *ev);
     bool wantsOverride(QKeyEvent *ev);
     void handleCommand(const QString &cmd); // sets m_tc + handleExCommand
     void handleExCommand(const QString &cmd);
 
     void installEventFilter();
+    void commitCursor();
     void setupWidget();
     void restoreWidget();
 
@@ -214,7 +404,8 @@ public:
     EventResult handleCommandMode(int key, int unmodified, const QString &text);
     EventResult handleRegisterMode(int key, int unmodified, const QString &text);
     EventResult handleMiniBufferModes(int key, int unmodified, const QString &text);
-    bool exactMatch(int key, const QKeySequence& keySequence);
+    bool exactMatch(const QKeySequence &binding, const QKeySequence &keySequence);
+    static bool isPrefixKey(const QKeySequence &keySequence);
     void finishMovement(const QString &text = QString());
     void search(const QString &needle, bool forward);
     void highlightMatches(const QString &needle);
@@ -230,6 +421,48 @@ public:
   void killLine();
   void killWord();
   void backwardKillWord();
+  void indentRigidly();
+  void startKbdMacro();
+  void endKbdMacro();
+  void callLastKbdMacro();
+  void recordMacroStep(QKeyEvent *ev, EventResult result);
+  void executeMacro(const QVector<MacroStep> &macro, int times);
+  void runMacroSteps(const QVector<MacroStep> &macro);
+  void applyMacroToRegionLines();
+  void copyToRegister();
+  void insertRegister();
+  void pointToRegister();
+  void jumpToRegister();
+  void numberToRegister();
+  void incrementRegister();
+  void killRectangle();
+  void yankRectangle();
+  void stringRectangle();
+  void undoTreeVisualize();
+
+  // commands bound to keys outside of the editor, see runCommand()
+  void runCommand(const QString &name);
+
+  // avy style jump to a character in the visible part of the document
+  void startJump(int chars);
+  void handleJumpKey(int key, const QString &text);
+  void collectJumpCandidates();
+  void showJumpLabels();
+  void cancelJump();
+  void jumpTo(int position);
+  const CharBitmap &charBitmap(const QTextBlock &block);
+
+  // M-% and C-M-%
+  void startQueryReplace();
+  void handleQueryReplaceKey(int key, const QString &text);
+  void showQueryMatch();
+  QString queryReplacement(const QueryReplaceMatch &match) const;
+  void replaceQueryMatch();
+  void replaceRemainingQueryMatches();
+  void finishQueryReplace();
+
+  // M-/
+  void dabbrevExpand();
   /*
   void charactersInserted(int line, int column, const QString& text);
   */
@@ -251,12 +484,18 @@ public:
     int cursorLineOnScreen() const;
     int linesOnScreen() const;
     int columnsOnScreen() const;
+    int firstVisibleLine() const;
     int cursorLineInDocument() const;
     int cursorColumnInDocument() const;
     int linesInDocument() const;
     void scrollToLineInDocument(int line);
     void scrollUp(int count);
     void scrollDown(int count) { scrollUp(-count); }
+    void recenterTopBottom(int cycle);
+
+    // viewport metrics, recomputed lazily after resize or font changes
+    const ScreenGeometry &screenGeometry() const;
+    void invalidateScreenGeometry() { m_screenGeometry.valid = false; }
 
     // helper functions for indenting
     bool isElectricCharacter(QChar c) const
@@ -264,6 +503,14 @@ public:
     void indentRegion(QChar lastTyped = QChar());
     void shiftRegionLeft(int repeat = 1);
     void shiftRegionRight(int repeat = 1);
+    void indentLines(int beginLine, int endLine, int columns);
+
+    // rectangles
+    bool rectangleBounds(int *beginLine, int *endLine,
+        int *startColumn, int *endColumn);
+    QStringList replaceRectangle(int beginLine, int endLine, int startColumn,
+        int endColumn, const QStringList &replacement, bool atStart);
+    void finishStringRectangle(const QString &string);
 
     void moveToFirstNonBlankOnLine();
     void moveToTargetColumn();
@@ -288,10 +535,36 @@ public:
     void setPosition(int position) { m_tc.setPosition(position, MoveAnchor); }
 
     void handleFfTt(int key);
+    void handleCharCommand(int key, const QString &text);
+    void handleRegisterCommand(CharCommand command, QChar name);
+    CharCommand m_charCommand;
 
     // helper function for handleExCommand. return 1 based line index.
-    int readLineCode(QString &cmd);
+    int readLineCode(const QString &cmd, int *pos, bool evaluate = true);
+    void parseExCommand(const QString &line, ExCommand *cmd);
+    int evaluateExRange(ExCommand *cmd, bool evaluate = true);
+    void parseExName(int pos, ExCommand *cmd);
+    void runExCommand(const ExCommand &cmd);
+    void exSource(const ExCommand &cmd);
+    void exQuit(const ExCommand &cmd);
+    void exDelete(const ExCommand &cmd);
+    void exWrite(const ExCommand &cmd);
+    void exRead(const ExCommand &cmd);
+    void exFilter(const ExCommand &cmd);
+    void exBufdo(const ExCommand &cmd);
+    void exShiftRight(const ExCommand &cmd);
+    void exRedo(const ExCommand &cmd);
+    void exNormal(const ExCommand &cmd);
+    void exSubstitute(const ExCommand &cmd);
+    void exSet(const ExCommand &cmd);
+    void exHistory(const ExCommand &cmd);
     void selectRange(int beginLine, int endLine);
+    void gotoLine(int line); // 1 based
+
+    // inserts (or with replace, loads) a file in the background
+    bool loadFile(const QString &fileName, bool replace);
+    void fileLoaded(const QString &fileName, int lines, qint64 characters);
+    bool loadInProgress();
 
     void enterInsertMode();
     void enterCommandMode();
@@ -300,8 +573,13 @@ public:
     void showBlackMessage(const QString &msg);
     void notImplementedYet();
     void updateMiniBuffer();
+    void scheduleStatus();
+    void updateStatus();
+    void completeExCommand();
+    void scheduleCompletion(QChar typed);
     void updateSelection();
     QWidget *editor() const;
+    QWidget *viewport() const { return EDITOR(viewport()); }
     QChar characterAtCursor() const
         { return m_tc.document()->characterAt(m_tc.position()); }
     void beginEditBlock() { UNDO_DEBUG("BEGIN EDIT BLOCK"); m_tc.beginEditBlock(); }
@@ -322,6 +600,10 @@ public:
     QString m_input;
     QTextCursor m_tc;
     QTextCursor m_oldTc; // copy from last event to check for external changes
+    QTimer m_cursorCommitTimer; // pending m_tc commit during key repeat
+    int m_committedPosition; // where the last commit left point
+    QTimer m_statusTimer; // pending statusDataChanged
+    QTimer m_completionTimer; // pending completionRequested
     int m_anchor;
     QHash<int, QString> m_registers;
     int m_register;
@@ -334,6 +616,9 @@ public:
 
     bool isSearchMode() const
         { return m_mode == SearchForwardMode || m_mode == SearchBackwardMode; }
+    bool isMiniBufferMode() const
+        { return m_mode != InsertMode && m_mode != CommandMode; }
+    QList<int> m_prefixKeys; // incomplete multi key command, e.g. M-g
     int m_gflag;  // whether current command started with 'g'
 
     QString m_commandBuffer;
@@ -351,7 +636,11 @@ public:
     // undo handling
     void undo();
     void redo();
-    QMap<int, int> m_undoCursorPosition; // revision -> position
+    void handleUndoTreeKey(int key, const QString &text);
+    QString undoTreeMessage() const;
+    UndoTree *m_undoTree; // shared by the editors of the document
+    UndoAmalgamation undoAmalgamation(const QKeyEvent *ev) const;
+    UndoAmalgamation m_amalgamation; // of the last command
 
     // extra data for '.'
     void replay(const QString &text, int count);
@@ -359,6 +648,8 @@ public:
     void setDotCommand(const QString &cmd, int n) { m_dotCommand = cmd.arg(n); }
     QString m_dotCommand;
     bool m_inReplay; // true if we are executing a '.'
+    bool m_batchMode; // no minibuffer or selection updates, e.g. in :source
+    int m_sourceDepth; // of nested :source commands
 
     // extra data for ';'
     QString m_semicolonCount;
@@ -368,6 +659,7 @@ public:
     // history for '/'
     QString lastSearchString() const;
     static QStringList m_searchHistory;
+    static QStringList m_killedRectangle; // shared like the kill ring
     int m_searchHistoryIndex;
 
     // history for ':'
@@ -384,10 +676,7 @@ public:
     QString m_oldNeedle;
 
     // vi style configuration
-    QVariant config(int code) const { return theEmacsKeysSetting(code)->value(); }
-    bool hasConfig(int code) const { return config(code).toBool(); }
-    bool hasConfig(int code, const char *value) const // FIXME
-        { return config(code).toString().contains(value); }
+    const EmacsKeysConfig &config() const { return theEmacsKeysConfig(); }
 
     // for restoring cursor position
     int m_savedYankPosition;
@@ -395,6 +684,9 @@ public:
 
     int m_cursorWidth;
 
+    mutable ScreenGeometry m_screenGeometry;
+    int m_recenterCycle; // position in the C-l middle/top/bottom cycle
+
     // auto-indent
     void insertAutomaticIndentation(bool goingDown);
     bool removeAutomaticIndentation(); // true if something removed
@@ -411,9 +703,42 @@ public:
 
     int yankEndPosition;
     int yankStartPosition;
+
+    JumpState m_jumpState;
+    int m_jumpCharsNeeded;
+    QString m_jumpNeedle;
+    QString m_jumpLabelInput;
+    QList<int> m_jumpCandidates; // positions, nearest to the cursor first
+    QStringList m_jumpLabels;
+    QHash<int, CharBitmap> m_charBitmaps; // block number -> bitmap
+    int m_charBitmapBlockCount;
+    QPointer<JumpLabelOverlay> m_jumpOverlay;
+
+    bool m_queryRegExp;
+    QString m_queryFrom;
+    QString m_queryTo;
+    QList<QueryReplaceMatch> m_queryMatches;
+    int m_queryIndex; // the match asked about
+    int m_queryOffset; // how much the replacements so far grew the text
+    int m_queryReplaced;
+    int m_queryRevision; // document revision after our last replacement
+
+    QString m_dabbrevPrefix;
+    QStringList m_dabbrevExpansions;
+    int m_dabbrevIndex; // expansion shown now, -1 for the prefix
+    int m_dabbrevStart; // where the prefix starts
+    int m_dabbrevRevision; // document revision after the last expansion
+
+    ArgumentState m_argumentState; // C-u prefix being typed
+    int m_registerCount; // C-u count of the register command reading a name
+    bool m_registerArgument; // whether it was given one at all
+    bool m_recordingMacro;
+    QVector<MacroStep> m_macro; // being recorded
+    QVector<MacroStep> m_lastMacro;
 };
 
 QStringList EmacsKeysHandler::Private::m_searchHistory;
+QStringList EmacsKeysHandler::Private::m_killedRectangle;
 QStringList EmacsKeysHandler::Private::m_commandHistory;
 
 EmacsKeysHandler::Private::Private(EmacsKeysHandler *parent, QWidget *widget)
@@ -440,8 +765,45 @@ void EmacsKeysHandler::Private::init()
     m_anchor = 0;
     m_savedYankPosition = 0;
     m_cursorWidth = EDITOR(cursorWidth());
+    m_recenterCycle = 0;
+    m_committedPosition = -1;
+    m_cursorCommitTimer.setSingleShot(true);
+    m_cursorCommitTimer.setInterval(16);
+    QObject::connect(&m_cursorCommitTimer, SIGNAL(timeout()),
+        q, SLOT(commitCursor()));
+    m_completionTimer.setSingleShot(true);
+    QObject::connect(&m_completionTimer, SIGNAL(timeout()),
+        q, SIGNAL(completionRequested()));
+    m_statusTimer.setSingleShot(true);
+    m_statusTimer.setInterval(16);
+    QObject::connect(&m_statusTimer, SIGNAL(timeout()),
+        q, SLOT(updateStatus()));
     m_inReplay = false;
+    m_batchMode = false;
+    m_sourceDepth = 0;
     m_justAutoIndented = 0;
+    m_charCommand = NoCharCommand;
+    m_queryRegExp = false;
+    m_queryIndex = 0;
+    m_queryOffset = 0;
+    m_queryReplaced = 0;
+    m_queryRevision = 0;
+    m_dabbrevIndex = -1;
+    m_dabbrevStart = 0;
+    m_dabbrevRevision = -1;
+    m_argumentState = NoArgument;
+    m_registerCount = 1;
+    m_registerArgument = false;
+    m_recordingMacro = false;
+    // indexed in the background from now on, for M-/ here and elsewhere
+    WordIndex::forDocument(EDITOR(document()));
+    m_undoTree = UndoTree::forDocument(EDITOR(document()));
+    QObject::connect(m_undoTree, SIGNAL(historyDiscarded()),
+        q, SLOT(undoHistoryDiscarded()));
+    m_amalgamation = NoAmalgamation;
+    m_jumpState = NoJump;
+    m_jumpCharsNeeded = 0;
+    m_charBitmapBlockCount = -1;
 }
 
 bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
@@ -450,6 +812,12 @@ bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
     const int mods = ev->modifiers();
     KEY_DEBUG("SHORTCUT OVERRIDE" << key << "  PASSING: " << m_passing);
 
+    // everything typed while jumping is a target or a label, and the
+    // second key of a multi key command belongs to us as well
+    if (m_jumpState != NoJump || m_charCommand != NoCharCommand
+            || !m_prefixKeys.isEmpty())
+        return true;
+
     if (key == Key_Escape) {
         // Not sure this feels good. People often hit Esc several times
         if (m_visualMode == NoVisualMode && m_mode == CommandMode)
@@ -457,6 +825,14 @@ bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
         return true;
     }
 
+    // M-/ is dabbrev-expand, not the code completion of EmacsKeys.kms
+    if (mods == Qt::AltModifier && key == Key_Slash)
+        return true;
+
+    // C-/ is undo, not Toggle Comment Selection
+    if (mods == Qt::ControlModifier && key == Key_Slash)
+        return true;
+
     // We are interested in overriding  most Ctrl key combinations
     if (mods == Qt::ControlModifier && key >= Key_A && key <= Key_Z && key != Key_X && key != Key_R && key != Key_S) {
         // Ctrl-K is special as it is the Core's default notion of QuickOpen
@@ -469,9 +845,27 @@ bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
     return false;
 }
 
-bool EmacsKeysHandler::Private::exactMatch(int key, const QKeySequence& keySequence)
+bool EmacsKeysHandler::Private::exactMatch(const QKeySequence &binding,
+    const QKeySequence &keySequence)
+{
+    return binding.matches(keySequence) == QKeySequence::ExactMatch;
+}
+
+bool EmacsKeysHandler::Private::isPrefixKey(const QKeySequence &keySequence)
+{
+    static const QKeySequence prefixes[] = {
+        QKeySequence(Qt::ALT + Qt::Key_G),
+        QKeySequence(Qt::CTRL + Qt::Key_C),
+    };
+    for (unsigned i = 0; i != sizeof(prefixes) / sizeof(prefixes[0]); ++i)
+        if (prefixes[i] == keySequence)
+            return true;
+    return false;
+}
+
+static QKeySequence makeKeySequence(const QList<int> &keys)
 {
-    return QKeySequence(key).matches(keySequence) == QKeySequence::ExactMatch;
+    return QKeySequence(keys.value(0), keys.value(1), keys.value(2), keys.value(3));
 }
 
 
@@ -635,6 +1029,174 @@ void EmacsKeysHandler::Private::backwardKillWord()
   }
   endEditBlock();
 }
+static const char jumpKeys[] = "asdfghjkl";
+static const int jumpKeyCount = sizeof(jumpKeys) - 1;
+
+void EmacsKeysHandler::Private::startJump(int chars)
+{
+    m_jumpState = JumpReadChars;
+    m_jumpCharsNeeded = chars;
+    m_jumpNeedle.clear();
+    m_jumpLabelInput.clear();
+    showBlackMessage(tr("Jump to char: "));
+}
+
+void EmacsKeysHandler::Private::handleJumpKey(int key, const QString &text)
+{
+    if (key == Key_Escape || text.isEmpty() || !text.at(0).isPrint()) {
+        cancelJump();
+        return;
+    }
+
+    if (m_jumpState == JumpReadChars) {
+        m_jumpNeedle += text.at(0);
+        showBlackMessage(tr("Jump to char: ") + m_jumpNeedle);
+        if (m_jumpNeedle.size() < m_jumpCharsNeeded)
+            return;
+        collectJumpCandidates();
+        if (m_jumpCandidates.isEmpty()) {
+            cancelJump();
+        } else if (m_jumpCandidates.size() == 1) {
+            jumpTo(m_jumpCandidates.first());
+        } else {
+            m_jumpState = JumpReadLabel;
+            showJumpLabels();
+        }
+        return;
+    }
+
+    m_jumpLabelInput += text.at(0);
+    int matches = 0;
+    int target = -1;
+    for (int i = 0; i != m_jumpLabels.size(); ++i) {
+        if (m_jumpLabels.at(i).startsWith(m_jumpLabelInput)) {
+            ++matches;
+            target = m_jumpCandidates.at(i);
+        }
+    }
+    if (matches == 0)
+        cancelJump();
+    else if (matches == 1)
+        jumpTo(target);
+    else
+        showJumpLabels();
+}
+
+// Finds all occurrences of m_jumpNeedle in the blocks on screen. Blocks
+// whose bitmap lacks one of the characters are skipped without looking
+// at their text. Lower case needles match case insensitively.
+void EmacsKeysHandler::Private::collectJumpCandidates()
+{
+    m_jumpCandidates.clear();
+    m_jumpLabels.clear();
+
+    const Qt::CaseSensitivity cs = m_jumpNeedle.toLower() == m_jumpNeedle
+        ? Qt::CaseInsensitive : Qt::CaseSensitive;
+    const QString folded = m_jumpNeedle.toLower();
+    QTextDocument *doc = m_tc.document();
+
+    QList<int> found;
+    QTextBlock block = doc->findBlockByNumber(firstVisibleLine());
+    for (int lines = linesOnScreen(); block.isValid() && lines > 0;
+            block = block.next()) {
+        if (!block.isVisible())
+            continue;
+        --lines;
+        const CharBitmap &bitmap = charBitmap(block);
+        bool candidate = true;
+        foreach (QChar c, folded)
+            candidate = candidate && bitmap.mayContain(c.unicode());
+        if (!candidate)
+            continue;
+        const QString text = block.text();
+        for (int i = text.indexOf(m_jumpNeedle, 0, cs); i != -1;
+                i = text.indexOf(m_jumpNeedle, i + 1, cs))
+            found.append(block.position() + i);
+    }
+
+    // nearest first, so that the closest targets get the short labels
+    const int pos = m_tc.position();
+    QMap<int, int> byDistance;
+    foreach (int candidate, found)
+        byDistance.insertMulti(qAbs(candidate - pos), candidate);
+    m_jumpCandidates = byDistance.values();
+
+    if (m_jumpCandidates.size() <= jumpKeyCount) {
+        for (int i = 0; i != m_jumpCandidates.size(); ++i)
+            m_jumpLabels.append(QString(QLatin1Char(jumpKeys[i])));
+    } else {
+        const int n = qMin(m_jumpCandidates.size(), jumpKeyCount * jumpKeyCount);
+        m_jumpCandidates = m_jumpCandidates.mid(0, n);
+        for (int i = 0; i != n; ++i)
+            m_jumpLabels.append(QString(QLatin1Char(jumpKeys[i / jumpKeyCount]))
+                + QLatin1Char(jumpKeys[i % jumpKeyCount]));
+    }
+}
+
+const CharBitmap &EmacsKeysHandler::Private::charBitmap(const QTextBlock &block)
+{
+    // block numbers shift when lines come or go
+    const int blockCount = block.document()->blockCount();
+    if (blockCount != m_charBitmapBlockCount) {
+        m_charBitmaps.clear();
+        m_charBitmapBlockCount = blockCount;
+    }
+
+    CharBitmap &bitmap = m_charBitmaps[block.blockNumber()];
+    if (bitmap.revision == block.revision() && bitmap.length == block.length())
+        return bitmap;
+    bitmap = CharBitmap();
+    bitmap.revision = block.revision();
+    bitmap.length = block.length();
+    const QString text = block.text();
+    for (int i = 0, n = text.size(); i != n; ++i)
+        bitmap.add(text.at(i).toLower().unicode());
+    return bitmap;
+}
+
+void EmacsKeysHandler::Private::showJumpLabels()
+{
+    if (!m_jumpOverlay)
+        m_jumpOverlay = new JumpLabelOverlay(viewport());
+    m_jumpOverlay->setGeometry(viewport()->rect());
+    m_jumpOverlay->setFont(EDITOR(font()));
+
+    QList<QRect> rects;
+    QStringList labels;
+    QTextCursor tc = m_tc;
+    for (int i = 0; i != m_jumpCandidates.size(); ++i) {
+        const QString &label = m_jumpLabels.at(i);
+        if (!label.startsWith(m_jumpLabelInput))
+            continue;
+        tc.setPosition(m_jumpCandidates.at(i));
+        rects.append(EDITOR(cursorRect(tc)));
+        labels.append(label.mid(m_jumpLabelInput.size()));
+    }
+    m_jumpOverlay->setLabels(rects, labels);
+    m_jumpOverlay->show();
+    showBlackMessage(tr("Jump to: ") + m_jumpLabelInput);
+}
+
+void EmacsKeysHandler::Private::cancelJump()
+{
+    m_jumpState = NoJump;
+    if (m_jumpOverlay)
+        m_jumpOverlay->hide();
+    QApplication::beep();
+    showBlackMessage(QString());
+}
+
+void EmacsKeysHandler::Private::jumpTo(int position)
+{
+    m_jumpState = NoJump;
+    if (m_jumpOverlay)
+        m_jumpOverlay->hide();
+    setMark();
+    setPosition(position);
+    setTargetColumn();
+    showBlackMessage(QString());
+}
+
 /*
 
 void EmacsKeysHandler::Private::charactersInserted(int l, int c, const QString& text)
@@ -651,27 +1213,83 @@ void EmacsKeysHandler::Private::charactersInserted(int l, int c, const QString&
 
 EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
 {
-    int key = ev->key();
-    const int mods = ev->modifiers();
-    QKeySequence keySequence(ev->key() + ev->modifiers());
-
-    qDebug() << "sequence: " << keySequence << endl;
-
+    const int key = ev->key();
     if (key == Key_Shift || key == Key_Alt || key == Key_Control
             || key == Key_Alt || key == Key_AltGr || key == Key_Meta)
     {
         KEY_DEBUG("PLAIN MODIFIER");
         return EventUnhandled;
     }
+    if (loadInProgress())
+        return EventHandled;
 
-    // Fake "End of line"
-    m_tc = EDITOR(textCursor());
+    // While a key repeat burst is being collapsed m_tc is ahead of the
+    // editor's cursor and stays authoritative.
+    if (!m_cursorCommitTimer.isActive())
+        m_tc = EDITOR(textCursor());
+
+    // every command is one change in the undo tree, except that up to
+    // UndoTree::maxRun typed characters or deletions in a row are undone
+    // together, as long as point stays at the end of the last one and
+    // nothing else changed the document in between
+    const UndoAmalgamation amalgamation = undoAmalgamation(ev);
+    const bool joined = amalgamation != NoAmalgamation
+        && amalgamation == m_amalgamation
+        && m_undoTree->amalgamate(m_tc.position());
+    if (!joined)
+        m_undoTree->boundary(m_tc.position());
+    m_amalgamation = amalgamation;
+    // a key typed before the completion popped up supersedes it
+    m_completionTimer.stop();
+    // Qt merges plain typing into the last undo step of the document, so
+    // the key starting a run gets an edit block of its own, around the
+    // editor's handling of the key, too
+    const bool startsRun = amalgamation != NoAmalgamation && !joined;
+    if (startsRun)
+        beginEditBlock();
+    EventResult result = dispatchKey(ev);
+    const bool toEditor = result == EventUnhandled;
+    if (startsRun) {
+        if (toEditor) {
+            commitCursor();
+            static_cast<QObject *>(editor())->event(ev);
+            m_tc = EDITOR(textCursor());
+            result = EventHandled;
+        }
+        endEditBlock();
+    }
+    if (m_recordingMacro)
+        recordMacroStep(ev, toEditor ? EventUnhandled : result);
+    // characters the editor inserts itself ask for completion, too
+    if (toEditor && !ev->text().isEmpty()
+            && (ev->modifiers() & (Qt::ControlModifier | Qt::AltModifier)) == 0)
+        scheduleCompletion(ev->text().at(0));
+
+    if (result == EventHandled && ev->isAutoRepeat()) {
+        // repaint once per frame instead of once per auto-repeat event
+        if (!m_cursorCommitTimer.isActive())
+            m_cursorCommitTimer.start();
+    } else {
+        // unhandled keys go to the editor, which needs the real position
+        commitCursor();
+    }
+    return result;
+}
+
+// Runs the command bound to a key on m_tc. Keyboard macros are played
+// back through here without going through the editor.
+EventResult EmacsKeysHandler::Private::dispatchKey(QKeyEvent *ev)
+{
+    int key = ev->key();
+    const int mods = ev->modifiers();
+    QKeySequence keySequence(ev->key() + ev->modifiers());
 
     if (m_tc.position() != m_oldTc.position())
         setTargetColumn();
 
     m_tc.setVisualNavigation(true);
     
+    // Fake "End of line"
     if (m_fakeEnd)
         moveRight();
 
@@ -682,21 +1300,117 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
         key += 32;
     }
 
-    m_undoCursorPosition[m_tc.document()->revision()] = m_tc.position();
+    // C-u gives the next command a count of 4, each further C-u multiplies
+    // it by 4, and digits typed after C-u give the count directly.
+    bool hasArgument = false;
+    if (m_jumpState == NoJump && m_charCommand == NoCharCommand
+            && !isMiniBufferMode() && m_prefixKeys.isEmpty()) {
+        const QChar c = ev->text().isEmpty() ? QChar() : ev->text().at(0);
+        if (exactMatch(Qt::CTRL + Qt::Key_U, keySequence)) {
+            m_mvcount = QString::number(
+                m_argumentState == ArgumentMultiplied ? mvCount() * 4 : 4);
+            m_argumentState = ArgumentMultiplied;
+            showBlackMessage(QLatin1String("C-u ") + m_mvcount + QLatin1Char('-'));
+            m_oldTc = m_tc;
+            return EventHandled;
+        }
+        if (m_argumentState != NoArgument && c.isDigit()
+                && (mods & (Qt::ControlModifier | Qt::AltModifier)) == 0) {
+            if (m_argumentState == ArgumentMultiplied)
+                m_mvcount.clear();
+            m_mvcount += c;
+            m_argumentState = ArgumentDigits;
+            showBlackMessage(QLatin1String("C-u ") + m_mvcount + QLatin1Char('-'));
+            m_oldTc = m_tc;
+            return EventHandled;
+        }
+        if (m_argumentState != NoArgument) {
+            m_argumentState = NoArgument;
+            hasArgument = true;
+            showBlackMessage(QString());
+        }
+    }
+
+    // Collect multi key commands like M-g g. The prefix is echoed in the
+    // minibuffer until the command is complete.
+    if (m_jumpState == NoJump && m_charCommand == NoCharCommand
+            && !isMiniBufferMode()) {
+        m_prefixKeys.append(ev->key() + mods);
+        keySequence = makeKeySequence(m_prefixKeys);
+        if (isPrefixKey(keySequence)) {
+            showBlackMessage(keySequence.toString() + QLatin1Char('-'));
+            return EventHandled;
+        }
+        if (m_prefixKeys.size() > 1)
+            showBlackMessage(QString());
+        m_prefixKeys.clear();
+    }
+
+    qDebug() << "sequence: " << keySequence << endl;
+
+    // C-l cycles only while it is pressed repeatedly
+    const int recenterCycle = m_recenterCycle;
+    m_recenterCycle = 0;
 
     EventResult result = EventHandled;
-    if (exactMatch(Qt::CTRL + Qt::Key_N, keySequence)) {
-        m_tc.movePosition(QTextCursor::Down, QTextCursor::MoveAnchor);
+    if (m_jumpState != NoJump) {
+        handleJumpKey(ev->key(), ev->text());
+    } else if (m_charCommand != NoCharCommand) {
+        handleCharCommand(ev->key(), ev->text());
+    } else if (m_mode == QueryReplaceMode) {
+        handleQueryReplaceKey(key, ev->text());
+    } else if (m_mode == UndoTreeMode) {
+        handleUndoTreeKey(key, ev->text());
+    } else if (isMiniBufferMode()) {
+        result = handleMiniBufferModes(key, ev->key(), ev->text());
+    } else if (exactMatch(QKeySequence(Qt::ALT + Qt::Key_G, Qt::Key_G), keySequence)
+            || exactMatch(QKeySequence(Qt::ALT + Qt::Key_G, Qt::ALT + Qt::Key_G), keySequence)) {
+        enterExMode();
+        m_mode = GotoLineMode;
+        m_currentMessage.clear();
+        m_commandBuffer.clear();
+        updateMiniBuffer();
+    } else if (exactMatch(Qt::ALT + Qt::SHIFT + Qt::Key_Percent, keySequence)
+            || exactMatch(Qt::CTRL + Qt::ALT + Qt::SHIFT + Qt::Key_Percent, keySequence)) {
+        enterExMode();
+        m_mode = QueryReplaceFromMode;
+        m_queryRegExp = (mods & Qt::ControlModifier) != 0;
+        m_currentMessage.clear();
+        m_commandBuffer.clear();
+        updateMiniBuffer();
+    } else if (exactMatch(Qt::ALT + Qt::Key_Slash, keySequence)) {
+        dabbrevExpand();
+    } else if (exactMatch(Qt::CTRL + Qt::Key_Slash, keySequence)
+            || exactMatch(Qt::CTRL + Qt::SHIFT + Qt::Key_Underscore, keySequence)) {
+        undo();
+    } else if (exactMatch(Qt::CTRL + Qt::SHIFT + Qt::Key_Question, keySequence)
+            || exactMatch(Qt::ALT + Qt::SHIFT + Qt::Key_Underscore, keySequence)) {
+        redo();
+    } else if (exactMatch(Qt::ALT + Qt::Key_Z, keySequence)) {
+        m_charCommand = ZapToCharCommand;
+        showBlackMessage(tr("Zap to char: "));
+    } else if (exactMatch(QKeySequence(Qt::CTRL + Qt::Key_C, Qt::Key_F), keySequence)) {
+        m_charCommand = CharSearchForwardCommand;
+        showBlackMessage(tr("Search forward for char: "));
+    } else if (exactMatch(QKeySequence(Qt::CTRL + Qt::Key_C, Qt::Key_B), keySequence)) {
+        m_charCommand = CharSearchBackwardCommand;
+        showBlackMessage(tr("Search backward for char: "));
+    } else if (exactMatch(Qt::CTRL + Qt::Key_Semicolon, keySequence)) {
+        startJump(1);
+    } else if (exactMatch(Qt::CTRL + Qt::Key_Apostrophe, keySequence)) {
+        startJump(2);
+    } else if (exactMatch(Qt::CTRL + Qt::Key_N, keySequence)) {
+        m_tc.movePosition(QTextCursor::Down, QTextCursor::MoveAnchor, count());
     } else if (exactMatch(Qt::CTRL + Qt::Key_P, keySequence)) {
-        m_tc.movePosition(QTextCursor::Up, QTextCursor::MoveAnchor);
+        m_tc.movePosition(QTextCursor::Up, QTextCursor::MoveAnchor, count());
     } else if (exactMatch(Qt::CTRL + Qt::Key_A, keySequence)) {
         moveToStartOfLine();
     } else if (exactMatch(Qt::CTRL + Qt::Key_E, keySequence)) {
         moveToEndOfLine();
     } else if (exactMatch(Qt::CTRL + Qt::Key_B, keySequence)) {
-        moveLeft();
+        moveLeft(count());
     } else if (exactMatch(Qt::CTRL + Qt::Key_F, keySequence)) {
-        moveRight();
+        moveRight(count());
     } else if (exactMatch(Qt::ALT + Qt::Key_B, keySequence)) {
         moveToWordBoundary(false, false);
     } else if (exactMatch(Qt::ALT + Qt::Key_F, keySequence)) {
@@ -706,7 +1420,9 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
     } else if (exactMatch(Qt::ALT + Qt::Key_Backspace, keySequence)) {
         backwardKillWord();
     } else if (exactMatch(Qt::CTRL + Qt::Key_D, keySequence)) {
-        m_tc.deleteChar();
+        m_tc.setPosition(qMin(position() + count(), m_tc.document()->characterCount() - 1),
+            KeepAnchor);
+        m_tc.removeSelectedText();
     } else if (exactMatch(Qt::ALT + Qt::SHIFT + Qt::Key_Less, keySequence)) {
         m_tc.movePosition(QTextCursor::Start, QTextCursor::MoveAnchor);
     } else if (exactMatch(Qt::ALT + Qt::SHIFT + Qt::Key_Greater, keySequence)) {
@@ -717,8 +1433,14 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
     } else if (exactMatch(Qt::ALT + Qt::Key_V, keySequence)) {
         moveUp(count() * (linesOnScreen() - 2) + cursorLineOnScreen());
         scrollToLineInDocument(cursorLineInDocument() + linesOnScreen() - 2);
+    } else if (exactMatch(Qt::CTRL + Qt::Key_L, keySequence)) {
+        recenterTopBottom(recenterCycle);
     } else if (exactMatch(Qt::CTRL + Qt::Key_Space, keySequence)) {
-        setMark();
+        // C-u C-SPC jumps back to the mark
+        if (hasArgument)
+            popToMark();
+        else
+            setMark();
     } else if (exactMatch(Qt::CTRL + Qt::Key_K, keySequence)) {
         killLine();
     } else if (exactMatch(Qt::CTRL + Qt::Key_Y, keySequence)) {
@@ -729,22 +1451,51 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
         cut();
     } else if (exactMatch(Qt::ALT + Qt::Key_W, keySequence)) {
         copy();
-    } else if (QKeySequence(Qt::CTRL + Qt::Key_U, Qt::CTRL + Qt::Key_Space).matches(keySequence) == QKeySequence::ExactMatch) {
-        popToMark();
-    } else if (QKeySequence(Qt::CTRL + Qt::Key_X, Qt::Key_X).matches(keySequence) == QKeySequence::ExactMatch) {
+    } else if (exactMatch(QKeySequence(Qt::CTRL + Qt::Key_X, Qt::Key_X), keySequence)) {
         exchangeDotAndMark();
+    } else if (hasArgument && count() > 1 && !ev->text().isEmpty()
+            && ev->text().at(0).isPrint()
+            && (mods & (Qt::ControlModifier | Qt::AltModifier)) == 0) {
+        // C-u 5 a inserts five a
+        m_tc.insertText(ev->text().repeated(count()));
     } else {
       result = EventUnhandled;
     }
 
+    // the count belongs to this command unless it still reads input
+    if (m_argumentState == NoArgument && m_jumpState == NoJump
+            && m_charCommand == NoCharCommand && m_prefixKeys.isEmpty()
+            && !isMiniBufferMode())
+        m_mvcount.clear();
+
     m_oldTc = m_tc;
-    EDITOR(setTextCursor(m_tc));
     return result;
 }
 
 void EmacsKeysHandler::Private::installEventFilter()
 {
     EDITOR(installEventFilter(q));
+    viewport()->installEventFilter(q);
+}
+
+// Hands m_tc back to the editor. setTextCursor() scrolls, emits
+// cursorPositionChanged and repaints, so skip it if nothing moved. Edits
+// are done through m_tc directly and need no commit of their own, but
+// they move the editor's cursor along without scrolling to it.
+void EmacsKeysHandler::Private::commitCursor()
+{
+    m_cursorCommitTimer.stop();
+    scheduleStatus();
+    const int position = m_tc.position();
+    const bool moved = position != m_committedPosition;
+    m_committedPosition = position;
+    const QTextCursor tc = EDITOR(textCursor());
+    if (tc.position() == position && tc.anchor() == m_tc.anchor()) {
+        if (moved)
+            EDITOR(ensureCursorVisible());
+        return;
+    }
+    EDITOR(setTextCursor(m_tc));
 }
 
 void EmacsKeysHandler::Private::setupWidget()
@@ -936,6 +1687,8 @@ void EmacsKeysHandler::Private::finishMovement(const QString &dotCommand)
 
 void EmacsKeysHandler::Private::updateSelection()
 {
+    if (m_batchMode)
+        return;
     QList<QTextEdit::ExtraSelection> selections = m_searchSelections;
     if (m_visualMode != NoVisualMode) {
         QTextEdit::ExtraSelection sel;
@@ -970,17 +1723,24 @@ void EmacsKeysHandler::Private::updateSelection()
             int cursorColumn = cursorPos - cursorBlock.position();
             int startColumn = qMin(anchorColumn, cursorColumn);
             int endColumn = qMax(anchorColumn, cursorColumn);
-            int endPos = cursorBlock.position();
-            while (tc.position() <= endPos) {
-                if (startColumn < tc.block().length() - 1) {
-                    int last = qMin(tc.block().length() - 1, endColumn);
+            // walk the blocks by column instead of moving a cursor
+            // down and right for every line
+            QTextBlock block = anchorBlock;
+            QTextBlock lastBlock = cursorBlock;
+            if (block.blockNumber() > lastBlock.blockNumber())
+                qSwap(block, lastBlock);
+            for (; block.isValid(); block = block.next()) {
+                if (startColumn < block.length() - 1) {
+                    int last = qMin(block.length() - 1, endColumn);
                     int len = last - startColumn + 1;
-                    sel.cursor = tc;
-                    sel.cursor.movePosition(Right, MoveAnchor, startColumn);
-                    sel.cursor.movePosition(Right, KeepAnchor, len);
+                    sel.cursor.setPosition(block.position() + startColumn,
+                        MoveAnchor);
+                    sel.cursor.setPosition(block.position() + startColumn + len,
+                        KeepAnchor);
                     selections.append(sel);
                 }
-                tc.movePosition(Down, MoveAnchor, 1);
+                if (block == lastBlock)
+                    break;
             }
         }
     }
@@ -990,6 +1750,8 @@ void EmacsKeysHandler::Private::updateSelection()
 
 void EmacsKeysHandler::Private::updateMiniBuffer()
 {
+    if (m_batchMode)
+        return;
     QString msg;
     if (m_passing) {
         msg = "-- PASSING --  ";
@@ -1015,7 +1777,27 @@ void EmacsKeysHandler::Private::updateMiniBuffer()
             msg += '?';
         else if (m_mode == ExMode)
             msg += ':';
-        foreach (QChar c, m_commandBuffer) {
+        else if (m_mode == GotoLineMode)
+            msg += tr("Goto line: ");
+        else if (m_mode == QueryReplaceFromMode)
+            msg += m_queryRegExp ? tr("Query replace regexp: ") : tr("Query replace: ");
+        else if (m_mode == QueryReplaceToMode)
+            msg += tr("Query replace %1 with: ").arg(m_queryFrom);
+        else if (m_mode == StringRectangleMode)
+            msg += tr("String rectangle: ");
+        else if (m_mode == UndoTreeMode)
+            msg += undoTreeMessage();
+        else if (m_mode == QueryReplaceMode)
+            msg += tr("Query replacing %1 with %2: (y, n, !, . or q) ")
+                .arg(m_queryFrom, m_queryTo);
+        // only control characters like a typed tab need quoting
+        int plain = 0;
+        const int n = m_commandBuffer.size();
+        while (plain != n && m_commandBuffer.at(plain).unicode() >= 32)
+            ++plain;
+        msg += m_commandBuffer.left(plain);
+        for (int i = plain; i != n; ++i) {
+            const QChar c = m_commandBuffer.at(i);
             if (c.unicode() < 32) {
                 msg += '^';
                 msg += QChar(c.unicode() + 64);
@@ -1028,7 +1810,24 @@ void EmacsKeysHandler::Private::updateMiniBuffer()
     }
 
     emit q->commandBufferChanged(msg);
+    scheduleStatus();
+}
+
+// The position is shown at most once per frame, after every command and
+// every key the editor handles itself.
+void EmacsKeysHandler::Private::scheduleStatus()
+{
+    if (!m_statusTimer.isActive())
+        m_statusTimer.start();
+}
 
+// The minibuffer is shared by all editors and skips a status that did not
+// change itself.
+void EmacsKeysHandler::Private::updateStatus()
+{
+    // keys the editor handled itself moved its cursor, not ours
+    if (!m_cursorCommitTimer.isActive())
+        m_tc = EDITOR(textCursor());
     int linesInDoc = linesInDocument();
     int l = cursorLineInDocument();
     QString status;
@@ -1227,7 +2026,7 @@ EventResult EmacsKeysHandler::Private::handleCommandMode(int key, int unmodified
         m_commandHistoryIndex = m_commandHistory.size() - 1;
         updateMiniBuffer();
     } else if (key == '/' || key == '?') {
-        if (hasConfig(ConfigIncSearch)) {
+        if (config().incSearch) {
             // re-use the core dialog.
             emit q->findRequested(key == '?');
         } else {
@@ -1517,13 +2316,13 @@ EventResult EmacsKeysHandler::Private::handleCommandMode(int key, int unmodified
         handleStartOfLine();
         finishMovement();
     } else if (key == 'n') { // FIXME: see comment for '/'
-        if (hasConfig(ConfigIncSearch))
+        if (config().incSearch)
             emit q->findNextRequested(false);
         else
             search(lastSearchString(), m_lastSearchForward);
         recordJump();
     } else if (key == 'N') {
-        if (hasConfig(ConfigIncSearch))
+        if (config().incSearch)
             emit q->findNextRequested(true);
         else
             search(lastSearchString(), !m_lastSearchForward);
@@ -1719,6 +2518,9 @@ EventResult EmacsKeysHandler::Private::handleCommandMode(int key, int unmodified
 EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
     const QString &text)
 {
+    // a key typed before the completion popped up supersedes it
+    m_completionTimer.stop();
+
     if (key == Key_Escape || key == 27 || key == control('c')) {
         // start with '1', as one instance was already physically inserted
         // while typing
@@ -1766,7 +2568,7 @@ EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
         insertAutomaticIndentation(true);
     } else if (key == Key_Backspace || key == control('h')) {
         if (!removeAutomaticIndentation()) 
-            if (!m_lastInsertion.isEmpty() || hasConfig(ConfigBackspace, "start")) {
+            if (!m_lastInsertion.isEmpty() || config().backspaceStart) {
                 m_tc.deletePreviousChar();
                 m_lastInsertion.chop(1);
             }
@@ -1781,8 +2583,8 @@ EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
         removeAutomaticIndentation();
         moveUp(count() * (linesOnScreen() - 2));
         m_lastInsertion.clear();
-    } else if (key == Key_Tab && hasConfig(ConfigExpandTab)) {
-        QString str = QString(theEmacsKeysSetting(ConfigTabStop)->value().toInt(), ' ');
+    } else if (key == Key_Tab && config().expandTab) {
+        QString str = QString(config().tabStop, ' ');
         m_lastInsertion.append(str);
         m_tc.insertText(str);
     } else if (key >= control('a') && key <= control('z')) {
@@ -1796,7 +2598,7 @@ EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
                 m_tc.deleteChar();
         }
         m_tc.insertText(text);
-        if (0 && hasConfig(ConfigAutoIndent) && isElectricCharacter(text.at(0))) {
+        if (0 && config().autoIndent && isElectricCharacter(text.at(0))) {
             const QString leftText = m_tc.block().text()
                 .left(m_tc.position() - 1 - m_tc.block().position());
             if (leftText.simplified().isEmpty())
@@ -1804,7 +2606,7 @@ EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
         }
 
         if (!m_inReplay)
-            emit q->completionRequested();
+            scheduleCompletion(text.at(0));
     } else {
         return EventUnhandled;
     }
@@ -1812,12 +2614,24 @@ EventResult EmacsKeysHandler::Private::handleInsertMode(int key, int,
     return EventHandled;
 }
 
+// Completion is requested once typing pauses for the configured delay,
+// so that fast typing does not start a code model query per key. Keys
+// that cannot be part of an identifier or start a member access do not
+// schedule one.
+void EmacsKeysHandler::Private::scheduleCompletion(QChar typed)
+{
+    if (!typed.isLetterOrNumber() && typed != '_' && typed != '.'
+            && typed != '>' && typed != ':')
+        return;
+    m_completionTimer.start(config().completionDelay);
+}
+
 EventResult EmacsKeysHandler::Private::handleMiniBufferModes(int key, int unmodified,
     const QString &text)
 {
     Q_UNUSED(text)
 
-    if (key == Key_Escape || key == control('c')) {
+    if (key == Key_Escape || key == control('c') || key == control('g')) {
         m_commandBuffer.clear();
         enterCommandMode();
         updateMiniBuffer();
@@ -1840,6 +2654,33 @@ EventResult EmacsKeysHandler::Private::handleMiniBufferModes(int key, int unmodi
             handleExCommand(m_commandBuffer);
             leaveVisualMode();
         }
+    } else if (unmodified == Key_Return && m_mode == GotoLineMode) {
+        bool ok = false;
+        const int line = m_commandBuffer.toInt(&ok);
+        m_commandBuffer.clear();
+        enterCommandMode();
+        if (ok)
+            gotoLine(line);
+        else
+            showBlackMessage(tr("Expected a line number"));
+    } else if (unmodified == Key_Return && m_mode == QueryReplaceFromMode) {
+        m_queryFrom = m_commandBuffer;
+        m_commandBuffer.clear();
+        if (m_queryFrom.isEmpty())
+            enterCommandMode();
+        else
+            m_mode = QueryReplaceToMode;
+        updateMiniBuffer();
+    } else if (unmodified == Key_Return && m_mode == QueryReplaceToMode) {
+        m_queryTo = m_commandBuffer;
+        m_commandBuffer.clear();
+        startQueryReplace();
+    } else if (unmodified == Key_Return && m_mode == StringRectangleMode) {
+        const QString string = m_commandBuffer;
+        m_commandBuffer.clear();
+        enterCommandMode();
+        finishStringRectangle(string);
+        updateMiniBuffer();
     } else if (unmodified == Key_Return && isSearchMode()) {
         if (!m_commandBuffer.isEmpty()) {
             m_searchHistory.takeLast();
@@ -1872,6 +2713,8 @@ EventResult EmacsKeysHandler::Private::handleMiniBufferModes(int key, int unmodi
             ++m_commandHistoryIndex;
             showBlackMessage(m_commandHistory.at(m_commandHistoryIndex));
         }
+    } else if (key == Key_Tab && m_mode == ExMode) {
+        completeExCommand();
     } else if (key == Key_Tab) {
         m_commandBuffer += QChar(9);
         updateMiniBuffer();
@@ -1885,64 +2728,130 @@ EventResult EmacsKeysHandler::Private::handleMiniBufferModes(int key, int unmodi
     return EventHandled;
 }
 
-// 1 based.
-int EmacsKeysHandler::Private::readLineCode(QString &cmd)
+// 1 based. Reads a line specification at *pos and advances *pos past it.
+// Without evaluate only *pos is advanced and 0 returned, for finding
+// where a range ends before the lines it names are known.
+int EmacsKeysHandler::Private::readLineCode(const QString &cmd, int *pos,
+    bool evaluate)
 {
-    //qDebug() << "CMD: " << cmd;
-    if (cmd.isEmpty())
+    //qDebug() << "CMD: " << cmd << *pos;
+    const int n = cmd.size();
+    if (*pos >= n)
         return -1;
-    QChar c = cmd.at(0);
-    cmd = cmd.mid(1);
-    if (c == '.')
-        return cursorLineInDocument() + 1;
-    if (c == '$')
-        return linesInDocument();
-    if (c == '\'' && !cmd.isEmpty()) {
-        int mark = m_marks.value(cmd.at(0).unicode());
-        if (!mark) {
-            showRedMessage(tr("E20: Mark '%1' not set").arg(cmd.at(0)));
-            cmd = cmd.mid(1);
+    QChar c = cmd.at(*pos);
+    if (c == '.') {
+        ++*pos;
+        return evaluate ? cursorLineInDocument() + 1 : 0;
+    }
+    if (c == '$') {
+        ++*pos;
+        return evaluate ? linesInDocument() : 0;
+    }
+    if (c == '\'' && *pos + 1 < n) {
+        const QChar name = cmd.at(*pos + 1);
+        *pos += 2;
+        if (!evaluate)
+            return 0;
+        int mark = m_marks.value(name.unicode(), -1);
+        //qDebug() << " MARK: " << name << mark << lineForPosition(mark);
+        if (mark == -1) {
+            showRedMessage(tr("E20: Mark '%1' not set").arg(name));
             return -1;
         }
-        cmd = cmd.mid(1);
         return lineForPosition(mark);
     }
     if (c == '-') {
-        int n = readLineCode(cmd);
-        return cursorLineInDocument() + 1 - (n == -1 ? 1 : n);
+        ++*pos;
+        int offset = readLineCode(cmd, pos, evaluate);
+        if (!evaluate)
+            return 0;
+        return cursorLineInDocument() + 1 - (offset == -1 ? 1 : offset);
     }
     if (c == '+') {
-        int n = readLineCode(cmd);
-        return cursorLineInDocument() + 1 + (n == -1 ? 1 : n);
-    }
-    if (c == '\'' && !cmd.isEmpty()) {
-        int pos = m_marks.value(cmd.at(0).unicode(), -1);
-        //qDebug() << " MARK: " << cmd.at(0) << pos << lineForPosition(pos);
-        if (pos == -1) {
-            showRedMessage(tr("E20: Mark '%1' not set").arg(cmd.at(0)));
-            cmd = cmd.mid(1);
-            return -1;
-        }
-        cmd = cmd.mid(1);
-        return lineForPosition(pos);
+        ++*pos;
+        int offset = readLineCode(cmd, pos, evaluate);
+        if (!evaluate)
+            return 0;
+        return cursorLineInDocument() + 1 + (offset == -1 ? 1 : offset);
     }
     if (c.isDigit()) {
-        int n = c.unicode() - '0';
-        while (!cmd.isEmpty()) {
-            c = cmd.at(0);
-            if (!c.isDigit())
-                break;
-            cmd = cmd.mid(1);
-            n = n * 10 + (c.unicode() - '0');
-        }
-        //qDebug() << "N: " << n;
-        return n;
+        int line = 0;
+        for (; *pos < n && (c = cmd.at(*pos)).isDigit(); ++*pos)
+            line = line * 10 + (c.unicode() - '0');
+        //qDebug() << "N: " << line;
+        return line;
     }
     // not parsed
-    cmd = c + cmd;
     return -1;
 }
 
+// Splits "[range]name[!] [args]" in a single pass over the line.
+void EmacsKeysHandler::Private::parseExCommand(const QString &line, ExCommand *cmd)
+{
+    cmd->line = line;
+    parseExName(evaluateExRange(cmd), cmd);
+}
+
+// Sets the lines of cmd->line's range and returns the index after it.
+// Without evaluate the lines are left alone, the index is the same, as the
+// same code reads the range both ways.
+int EmacsKeysHandler::Private::evaluateExRange(ExCommand *cmd, bool evaluate)
+{
+    const QString &line = cmd->line;
+    const int n = line.size();
+    int pos = 0;
+    cmd->beginLine = -1;
+    cmd->endLine = -1;
+
+    if (pos < n && line.at(pos) == '%') {
+        ++pos;
+        if (evaluate) {
+            cmd->beginLine = 1;
+            cmd->endLine = linesInDocument();
+        }
+    } else {
+        const int beginLine = readLineCode(line, &pos, evaluate);
+        int endLine = -1;
+        if (pos < n && line.at(pos) == ',') {
+            ++pos;
+            endLine = readLineCode(line, &pos, evaluate);
+        }
+        if (evaluate) {
+            cmd->beginLine = beginLine;
+            cmd->endLine = endLine;
+        }
+    }
+    return pos;
+}
+
+void EmacsKeysHandler::Private::parseExName(int pos, ExCommand *cmd)
+{
+    const QString &line = cmd->line;
+    const int n = line.size();
+    cmd->bang = false;
+
+    // a run of letters, or a single character like '!' or '>'
+    const int nameStart = pos;
+    while (pos < n && line.at(pos).isLetter())
+        ++pos;
+    if (pos == nameStart && pos < n)
+        ++pos;
+    cmd->name = line.mid(nameStart, pos - nameStart);
+    cmd->info = findExCommand(cmd->name);
+    cmd->flags = cmd->info ? cmd->info->flags : 0;
+
+    if (pos < n && line.at(pos) == '!' && pos > nameStart
+            && line.at(nameStart).isLetter()) {
+        cmd->bang = true;
+        ++pos;
+    }
+    while (pos < n && line.at(pos).isSpace())
+        ++pos;
+    cmd->args = line.mid(pos);
+    //qDebug() << "RANGE: " << cmd->beginLine << cmd->endLine << cmd->name << cmd->args;
+}
+
+
 void EmacsKeysHandler::Private::selectRange(int beginLine, int endLine)
 {
     if (beginLine == -1)
@@ -1958,256 +2867,561 @@ void EmacsKeysHandler::Private::selectRange(int beginLine, int endLine)
        setPosition(firstPositionInLine(endLine + 1));
 }
 
-void EmacsKeysHandler::Private::handleCommand(const QString &cmd)
+// Scrolls before moving so that committing the cursor finds it visible.
+// QPlainTextEdit then only lays out the lines that end up on screen, and
+// findBlockByNumber() does not depend on the size of the document.
+void EmacsKeysHandler::Private::gotoLine(int line)
 {
-    m_tc = EDITOR(textCursor());
-    handleExCommand(cmd);
-    EDITOR(setTextCursor(m_tc));
+    const QTextDocument *doc = m_tc.document();
+    line = qBound(1, line, doc->blockCount());
+    setMark();
+    scrollToLineInDocument(line - 1 - linesOnScreen() / 2);
+    setPosition(doc->findBlockByNumber(line - 1).position());
+    setTargetColumn();
+    showBlackMessage(tr("Line %1 of %2").arg(line).arg(doc->blockCount()));
 }
 
-void EmacsKeysHandler::Private::handleExCommand(const QString &cmd0)
+bool EmacsKeysHandler::Private::loadFile(const QString &fileName, bool replace)
 {
-    QString cmd = cmd0;
-    if (cmd.startsWith(QLatin1Char('%')))
-        cmd = "1,$" + cmd.mid(1);
-
-    int beginLine = -1;
-    int endLine = -1;
-
-    int line = readLineCode(cmd);
-    if (line != -1)
-        beginLine = line;
-
-    if (cmd.startsWith(',')) {
-        cmd = cmd.mid(1);
-        line = readLineCode(cmd);
-        if (line != -1)
-            endLine = line;
+    FileInserter *inserter = new FileInserter(m_tc.document(), editor(), q);
+    if (!inserter->start(fileName, position(), replace)) {
+        showRedMessage(tr("Cannot open file '%1' for reading: %2")
+            .arg(fileName).arg(inserter->errorString()));
+        delete inserter;
+        return false;
     }
+    QObject::connect(inserter, SIGNAL(finished(QString,int,qint64)),
+        q, SLOT(fileLoaded(QString,int,qint64)));
+    return true;
+}
 
-    //qDebug() << "RANGE: " << beginLine << endLine << cmd << cmd0 << m_marks;
+void EmacsKeysHandler::Private::fileLoaded(const QString &fileName,
+    int lines, qint64 characters)
+{
+    showBlackMessage(tr("\"%1\" %2L, %3C")
+        .arg(fileName).arg(lines).arg(characters));
+}
 
-    static QRegExp reQuit("^qa?!?$");
-    static QRegExp reDelete("^d( (.*))?$");
-    static QRegExp reHistory("^his(tory)?( (.*))?$");
-    static QRegExp reNormal("^norm(al)?( (.*))?$");
-    static QRegExp reSet("^set?( (.*))?$");
-    static QRegExp reWrite("^[wx]q?a?!?( (.*))?$");
-    static QRegExp reSubstitute("^s(.)(.*)\\1(.*)\\1([gi]*)");
+// Commands are refused while a file comes in, the chunks still to come
+// would otherwise join their undo step.
+bool EmacsKeysHandler::Private::loadInProgress()
+{
+    if (!FileInserter::isLoading(EDITOR(document())))
+        return false;
+    QApplication::beep();
+    showBlackMessage(tr("Still loading a file into this buffer"));
+    return true;
+}
 
-    if (cmd.isEmpty()) {
-        setPosition(firstPositionInLine(beginLine));
+void EmacsKeysHandler::Private::handleCommand(const QString &cmd)
+{
+    if (loadInProgress())
+        return;
+    if (m_cursorCommitTimer.isActive())
+        commitCursor();
+    m_tc = EDITOR(textCursor());
+    handleExCommand(cmd);
+    commitCursor();
+}
+
+typedef void (EmacsKeysHandler::Private::*EmacsCommandHandler)();
+
+struct EmacsCommandInfo
+{
+    const char *name;
+    EmacsCommandHandler handler;
+};
+
+// Commands whose keys start with C-x. Qt Creator's shortcuts see those
+// before the editor does, so the plugin binds them as actions that run
+// the command by name.
+static const EmacsCommandInfo emacsCommands[] = {
+    { "apply-macro-to-region-lines", &EmacsKeysHandler::Private::applyMacroToRegionLines },
+    { "call-last-kbd-macro", &EmacsKeysHandler::Private::callLastKbdMacro },
+    { "copy-to-register", &EmacsKeysHandler::Private::copyToRegister },
+    { "end-kbd-macro", &EmacsKeysHandler::Private::endKbdMacro },
+    { "increment-register", &EmacsKeysHandler::Private::incrementRegister },
+    { "indent-rigidly", &EmacsKeysHandler::Private::indentRigidly },
+    { "insert-register", &EmacsKeysHandler::Private::insertRegister },
+    { "jump-to-register", &EmacsKeysHandler::Private::jumpToRegister },
+    { "kill-rectangle", &EmacsKeysHandler::Private::killRectangle },
+    { "number-to-register", &EmacsKeysHandler::Private::numberToRegister },
+    { "point-to-register", &EmacsKeysHandler::Private::pointToRegister },
+    { "start-kbd-macro", &EmacsKeysHandler::Private::startKbdMacro },
+    { "string-rectangle", &EmacsKeysHandler::Private::stringRectangle },
+    { "undo-tree-visualize", &EmacsKeysHandler::Private::undoTreeVisualize },
+    { "yank-rectangle", &EmacsKeysHandler::Private::yankRectangle },
+};
+
+static EmacsCommandHandler emacsCommand(const QString &name)
+{
+    for (unsigned i = 0; i != sizeof(emacsCommands) / sizeof(emacsCommands[0]); ++i) {
+        if (name == QLatin1String(emacsCommands[i].name))
+            return emacsCommands[i].handler;
+    }
+    return 0;
+}
+
+// The commands that define and run macros are not part of one.
+static bool isMacroCommand(EmacsCommandHandler handler)
+{
+    return handler == &EmacsKeysHandler::Private::startKbdMacro
+        || handler == &EmacsKeysHandler::Private::endKbdMacro
+        || handler == &EmacsKeysHandler::Private::callLastKbdMacro
+        || handler == &EmacsKeysHandler::Private::applyMacroToRegionLines;
+}
+
+void EmacsKeysHandler::Private::runCommand(const QString &name)
+{
+    if (loadInProgress())
+        return;
+    if (m_cursorCommitTimer.isActive())
+        commitCursor();
+    m_tc = EDITOR(textCursor());
+    m_undoTree->boundary(m_tc.position());
+    m_amalgamation = NoAmalgamation;
+    if (EmacsCommandHandler handler = emacsCommand(name)) {
+        if (m_recordingMacro && !isMacroCommand(handler)) {
+            MacroStep step = { MacroStep::Command, 0, 0, name };
+            m_macro.append(step);
+        }
+        (this->*handler)();
+        // a pending C-u count was for this command
+        m_argumentState = NoArgument;
+        m_mvcount.clear();
+        commitCursor();
+        return;
+    }
+    QApplication::beep();
+    showBlackMessage(tr("%1 is undefined").arg(name));
+}
+
+// Looked up by abbreviation, the first entry that accepts the name wins.
+static const ExCommandInfo exCommands[] = {
+    { "!", 1, &EmacsKeysHandler::Private::exFilter, 0 },
+    { ">", 1, &EmacsKeysHandler::Private::exShiftRight, 0 },
+    { "bufdo", 5, &EmacsKeysHandler::Private::exBufdo, 0 },
+    { "delete", 1, &EmacsKeysHandler::Private::exDelete, 0 },
+    { "edit", 1, &EmacsKeysHandler::Private::exRead, ExReplace },
+    { "history", 3, &EmacsKeysHandler::Private::exHistory, 0 },
+    { "normal", 4, &EmacsKeysHandler::Private::exNormal, 0 },
+    { "qall", 2, &EmacsKeysHandler::Private::exQuit, ExQuitAll },
+    { "quit", 1, &EmacsKeysHandler::Private::exQuit, 0 },
+    { "read", 1, &EmacsKeysHandler::Private::exRead, 0 },
+    { "redo", 3, &EmacsKeysHandler::Private::exRedo, 0 },
+    { "set", 2, &EmacsKeysHandler::Private::exSet, 0 },
+    { "source", 2, &EmacsKeysHandler::Private::exSource, 0 },
+    { "substitute", 1, &EmacsKeysHandler::Private::exSubstitute, 0 },
+    { "wq", 2, &EmacsKeysHandler::Private::exWrite, ExQuit },
+    { "wqall", 3, &EmacsKeysHandler::Private::exWrite, ExQuit | ExQuitAll },
+    { "write", 1, &EmacsKeysHandler::Private::exWrite, 0 },
+    { "xall", 2, &EmacsKeysHandler::Private::exWrite, ExQuit | ExQuitAll },
+    { "xit", 1, &EmacsKeysHandler::Private::exWrite, ExQuit },
+};
+
+static const ExCommandInfo *findExCommand(const QString &name)
+{
+    const int n = name.size();
+    for (unsigned i = 0; i != sizeof(exCommands) / sizeof(exCommands[0]); ++i) {
+        const ExCommandInfo &info = exCommands[i];
+        if (n < info.minLength || n > int(qstrlen(info.name)))
+            continue;
+        int j = 0;
+        while (j < n && name.at(j) == QLatin1Char(info.name[j]))
+            ++j;
+        if (j == n)
+            return &info;
+    }
+    return 0;
+}
+
+// Completes the name of the ex command being typed as far as it is
+// unambiguous, like minibuffer-complete.
+void EmacsKeysHandler::Private::completeExCommand()
+{
+    ExCommand cmd;
+    cmd.line = m_commandBuffer;
+    const int nameStart = evaluateExRange(&cmd, false);
+    const QString name = m_commandBuffer.mid(nameStart);
+    QString completion;
+    for (unsigned i = 0; i != sizeof(exCommands) / sizeof(exCommands[0]); ++i) {
+        const QString candidate = QLatin1String(exCommands[i].name);
+        if (!candidate.at(0).isLetter() || !candidate.startsWith(name))
+            continue;
+        if (completion.isNull()) {
+            completion = candidate + QLatin1Char(' ');
+            continue;
+        }
+        int j = name.size();
+        while (j < completion.size() && j < candidate.size()
+                && completion.at(j) == candidate.at(j))
+            ++j;
+        completion.truncate(j);
+    }
+    if (completion.size() <= name.size()) {
+        QApplication::beep();
+        return;
+    }
+    m_commandBuffer = m_commandBuffer.left(nameStart) + completion;
+    updateMiniBuffer();
+}
+
+void EmacsKeysHandler::Private::handleExCommand(const QString &line)
+{
+    ExCommand cmd;
+    parseExCommand(line, &cmd);
+    runExCommand(cmd);
+}
+
+void EmacsKeysHandler::Private::runExCommand(const ExCommand &cmd)
+{
+    if (cmd.name.isEmpty()) {
+        // a bare ":" just leaves the minibuffer
+        if (cmd.beginLine != -1)
+            gotoLine(cmd.beginLine);
         showBlackMessage(QString());
         enterCommandMode();
-    } else if (reQuit.indexIn(cmd) != -1) { // :q
-        showBlackMessage(QString());
-        if (cmd.contains(QChar('a')))
-            q->quitAllRequested(cmd.contains(QChar('!')));
-        else
-            q->quitRequested(cmd.contains(QChar('!')));
-    } else if (reDelete.indexIn(cmd) != -1) { // :d
-        selectRange(beginLine, endLine);
-        QString reg = reDelete.cap(2);
-        QString text = removeSelectedText();
-        if (!reg.isEmpty())
-            m_registers[reg.at(0).unicode()] = text;
-    } else if (reWrite.indexIn(cmd) != -1) { // :w and :x
+        return;
+    }
+
+    if (!cmd.info) {
         enterCommandMode();
-        bool noArgs = (beginLine == -1);
-        if (beginLine == -1)
-            beginLine = 0;
-        if (endLine == -1)
-            endLine = linesInDocument();
-        //qDebug() << "LINES: " << beginLine << endLine;
-        int indexOfSpace = cmd.indexOf(QChar(' '));
-        QString prefix;
-        if (indexOfSpace < 0)
-            prefix = cmd;
+        showRedMessage(tr("E492: Not an editor command: ") + cmd.line);
+        return;
+    }
+    (this->*(cmd.info->handler))(cmd);
+}
+
+// Runs a file of ex commands as one undo step. The script is read and
+// parsed up front, and the minibuffer and selections are only updated
+// once all commands are done. Scripts may source others, but not deeper
+// than this, so one that sources itself ends.
+static const int MaxSourceDepth = 16;
+
+void EmacsKeysHandler::Private::exSource(const ExCommand &cmd) // :source
+{
+    enterCommandMode();
+    if (m_sourceDepth == MaxSourceDepth) {
+        showRedMessage(tr("E169: Command too recursive"));
+        return;
+    }
+    QFile file(cmd.args);
+    if (!file.open(QIODevice::ReadOnly)) {
+        showRedMessage(tr("E484: Can't open file %1").arg(cmd.args));
+        return;
+    }
+    QList<ExCommand> script;
+    QTextStream ts(&file);
+    while (!ts.atEnd()) {
+        ExCommand command;
+        command.line = ts.readLine().trimmed();
+        // '"' starts a comment line
+        if (command.line.isEmpty() || command.line.startsWith('"'))
+            continue;
+        parseExName(evaluateExRange(&command, false), &command);
+        script.append(command);
+    }
+
+    const bool wasBatchMode = m_batchMode;
+    m_batchMode = true;
+    ++m_sourceDepth;
+    beginEditBlock();
+    for (int i = 0; i != script.size(); ++i) {
+        evaluateExRange(&script[i]);
+        runExCommand(script.at(i));
+    }
+    endEditBlock();
+    --m_sourceDepth;
+    m_batchMode = wasBatchMode;
+
+    if (!m_batchMode) {
+        updateSelection();
+        if (m_currentMessage.isEmpty())
+            showBlackMessage(tr("\"%1\" %n commands executed", 0, script.size())
+                .arg(cmd.args));
         else
-            prefix = cmd.left(indexOfSpace);
-        bool forced = prefix.contains(QChar('!'));
-        bool quit = prefix.contains(QChar('q')) || prefix.contains(QChar('x'));
-        bool quitAll = quit && prefix.contains(QChar('a'));
-        QString fileName = reWrite.cap(2);
-        if (fileName.isEmpty())
-            fileName = m_currentFileName;
-        QFile file1(fileName);
-        bool exists = file1.exists();
-        if (exists && !forced && !noArgs) {
-            showRedMessage(tr("File '%1' exists (add ! to override)").arg(fileName));
-        } else if (file1.open(QIODevice::ReadWrite)) {
-            file1.close();
-            QTextCursor tc = m_tc;
-            selectRange(beginLine, endLine);
-            QString contents = selectedText();
-            m_tc = tc;
-            qDebug() << "LINES: " << beginLine << endLine;
-            bool handled = false;
-            emit q->writeFileRequested(&handled, fileName, contents);
+            updateMiniBuffer();
+    }
+}
+
+void EmacsKeysHandler::Private::exQuit(const ExCommand &cmd) // :q
+{
+    showBlackMessage(QString());
+    if (cmd.flags & ExQuitAll)
+        q->quitAllRequested(cmd.bang);
+    else
+        q->quitRequested(cmd.bang);
+}
+
+void EmacsKeysHandler::Private::exDelete(const ExCommand &cmd) // :d
+{
+    selectRange(cmd.beginLine, cmd.endLine);
+    QString text = removeSelectedText();
+    if (!cmd.args.isEmpty())
+        m_registers[cmd.args.at(0).unicode()] = text;
+}
+
+void EmacsKeysHandler::Private::exWrite(const ExCommand &cmd) // :w and :x
+{
+    enterCommandMode();
+    bool noArgs = (cmd.beginLine == -1);
+    int beginLine = cmd.beginLine == -1 ? 0 : cmd.beginLine;
+    int endLine = cmd.endLine == -1 ? linesInDocument() : cmd.endLine;
+    //qDebug() << "LINES: " << beginLine << endLine;
+    bool forced = cmd.bang;
+    bool quit = cmd.flags & ExQuit;
+    bool quitAll = cmd.flags & ExQuitAll;
+    QString fileName = cmd.args;
+    if (fileName.isEmpty())
+        fileName = m_currentFileName;
+    const bool exists = QFileInfo(fileName).exists();
+    if (exists && !forced && !noArgs) {
+        showRedMessage(tr("File '%1' exists (add ! to override)").arg(fileName));
+    } else {
+        const QTextDocument *doc = m_tc.document();
+        const int firstLine = qMax(beginLine, 1);
+        bool handled = false;
+        bool written = true;
+        int lines = 0;
+        qint64 bytes = 0;
+        emit q->writeFileRequested(&handled, fileName);
+        if (handled) {
+            // the core saves the whole document, and its last line
+            // has no line break
+            lines = linesInDocument() - 1;
+            bytes = QFileInfo(fileName).size();
+        } else {
             // nobody cared, so act ourselves
-            if (!handled) {
-                //qDebug() << "HANDLING MANUAL SAVE TO " << fileName;
-                QFile::remove(fileName);
-                QFile file2(fileName);
-                if (file2.open(QIODevice::ReadWrite)) {
-                    QTextStream ts(&file2);
-                    ts << contents;
-                } else {
-                    showRedMessage(tr("Cannot open file '%1' for writing").arg(fileName));
-                }
-            }
-            // check result by reading back
-            QFile file3(fileName);
-            file3.open(QIODevice::ReadOnly);
-            QByteArray ba = file3.readAll();
+            //qDebug() << "HANDLING MANUAL SAVE TO " << fileName;
+            DocumentWriter writer(fileName);
+            written = writer.write(doc->findBlockByNumber(firstLine - 1),
+                doc->findBlockByNumber(endLine - 1));
+            lines = writer.lines();
+            bytes = writer.bytes();
+            if (!written)
+                showRedMessage(tr("Cannot write file '%1': %2")
+                    .arg(fileName).arg(writer.errorString()));
+        }
+        if (written) {
             showBlackMessage(tr("\"%1\" %2 %3L, %4C written")
                 .arg(fileName).arg(exists ? " " : " [New] ")
-                .arg(ba.count('\n')).arg(ba.size()));
+                .arg(lines).arg(bytes));
             if (quitAll)
                 q->quitAllRequested(forced);
             else if (quit)
                 q->quitRequested(forced);
-        } else {
-            showRedMessage(tr("Cannot open file '%1' for reading").arg(fileName));
-        }
-    } else if (cmd.startsWith("r ")) { // :r
-        m_currentFileName = cmd.mid(2);
-        QFile file(m_currentFileName);
-        file.open(QIODevice::ReadOnly);
-        QTextStream ts(&file);
-        QString data = ts.readAll();
-        EDITOR(setPlainText(data));
-        enterCommandMode();
-        showBlackMessage(tr("\"%1\" %2L, %3C")
-            .arg(m_currentFileName).arg(data.count('\n')).arg(data.size()));
-    } else if (cmd.startsWith(QLatin1Char('!'))) {
-        selectRange(beginLine, endLine);
-        QString command = cmd.mid(1).trimmed();
-        QString text = removeSelectedText();
-        QProcess proc;
-        proc.start(cmd.mid(1));
-        proc.waitForStarted();
-        proc.write(text.toUtf8());
-        proc.closeWriteChannel();
-        proc.waitForFinished();
-        QString result = QString::fromUtf8(proc.readAllStandardOutput());
-        m_tc.insertText(result);
-        leaveVisualMode();
-        setPosition(firstPositionInLine(beginLine));
-        enterCommandMode();
-        //qDebug() << "FILTER: " << command;
-        showBlackMessage(tr("%n lines filtered", 0, text.count('\n')));
-    } else if (cmd.startsWith(QLatin1Char('>'))) {
-        m_anchor = firstPositionInLine(beginLine);
-        setPosition(firstPositionInLine(endLine));
-        shiftRegionRight(1);
-        leaveVisualMode();
-        enterCommandMode();
-        showBlackMessage(tr("%n lines >ed %1 time", 0, (endLine - beginLine + 1)).arg(1));
-    } else if (cmd == "red" || cmd == "redo") { // :redo
-        redo();
-        enterCommandMode();
-        updateMiniBuffer();
-    } else if (reNormal.indexIn(cmd) != -1) { // :normal
-        enterCommandMode();
-        //qDebug() << "REPLAY: " << reNormal.cap(3);
-        replay(reNormal.cap(3), 1);
-    } else if (reSubstitute.indexIn(cmd) != -1) { // :substitute
-        QString needle = reSubstitute.cap(2);
-        const QString replacement = reSubstitute.cap(3);
-        QString flags = reSubstitute.cap(4);
-        const bool startOfLineOnly = needle.startsWith('^');
-        if (startOfLineOnly)
-           needle.remove(0, 1);
-        needle.replace('$', '\n');
-        needle.replace("\\\n", "\\$");
-        QRegExp pattern(needle);
-        if (flags.contains('i'))
-            pattern.setCaseSensitivity(Qt::CaseInsensitive);
-        const bool global = flags.contains('g');
-        beginEditBlock();
-        for (int line = beginLine; line <= endLine; ++line) {
-            const int start = firstPositionInLine(line);
-            const int end = lastPositionInLine(line);
-            for (int position = start; position <= end && position >= start; ) {
-                position = pattern.indexIn(m_tc.document()->toPlainText(), position);
-                if (startOfLineOnly && position != start)
-                    break;
-                if (position != -1) {
-                    m_tc.setPosition(position);
-                    m_tc.movePosition(QTextCursor::NextCharacter,
-                        KeepAnchor, pattern.matchedLength());
-                    QString text = m_tc.selectedText();
-                    if (text.endsWith(ParagraphSeparator)) {
-                        text = replacement + "\n";
-                    } else {
-                        text.replace(ParagraphSeparator, "\n");
-                        text.replace(pattern, replacement);
-                    }
-                    m_tc.removeSelectedText();
-                    m_tc.insertText(text);
-                }
-                if (!global)
-                    break;
-            }
         }
-        endEditBlock();
-        enterCommandMode();
-    } else if (reSet.indexIn(cmd) != -1) { // :set
-        showBlackMessage(QString());
-        QString arg = reSet.cap(2);
-        SavedAction *act = theEmacsKeysSettings()->item(arg);
-        if (arg.isEmpty()) {
-            theEmacsKeysSetting(SettingsDialog)->trigger(QVariant());
-        } else if (act && act->value().type() == QVariant::Bool) {
-            // boolean config to be switched on
-            bool oldValue = act->value().toBool();
-            if (oldValue == false)
-                act->setValue(true);
-            else if (oldValue == true)
-                {} // nothing to do
-        } else if (act) {
-            // non-boolean to show
-            showBlackMessage(arg + '=' + act->value().toString());
-        } else if (arg.startsWith("no")
-                && (act = theEmacsKeysSettings()->item(arg.mid(2)))) {
-            // boolean config to be switched off
-            bool oldValue = act->value().toBool();
-            if (oldValue == true)
-                act->setValue(false);
-            else if (oldValue == false)
-                {} // nothing to do
-        } else if (arg.contains('=')) {
-            // non-boolean config to set
-            int p = arg.indexOf('=');
-            act = theEmacsKeysSettings()->item(arg.left(p));
-            if (act)
-                act->setValue(arg.mid(p + 1));
+    }
+}
+
+void EmacsKeysHandler::Private::exRead(const ExCommand &cmd) // :r and :e
+{
+    const bool replace = cmd.flags & ExReplace;
+    enterCommandMode();
+    if (loadFile(cmd.args, replace)) {
+        if (replace)
+            m_currentFileName = cmd.args;
+        showBlackMessage(tr("Reading \"%1\"...").arg(cmd.args));
+    }
+}
+
+void EmacsKeysHandler::Private::exFilter(const ExCommand &cmd) // :!
+{
+    selectRange(cmd.beginLine, cmd.endLine);
+    QString text = removeSelectedText();
+    QProcess proc;
+    proc.start(cmd.args);
+    proc.waitForStarted();
+    proc.write(text.toUtf8());
+    proc.closeWriteChannel();
+    proc.waitForFinished();
+    QString result = QString::fromUtf8(proc.readAllStandardOutput());
+    m_tc.insertText(result);
+    leaveVisualMode();
+    setPosition(firstPositionInLine(cmd.beginLine));
+    enterCommandMode();
+    //qDebug() << "FILTER: " << cmd.args;
+    showBlackMessage(tr("%n lines filtered", 0, text.count('\n')));
+}
+
+void EmacsKeysHandler::Private::exShiftRight(const ExCommand &cmd) // :>
+{
+    m_anchor = firstPositionInLine(cmd.beginLine);
+    setPosition(firstPositionInLine(cmd.endLine));
+    shiftRegionRight(1);
+    leaveVisualMode();
+    enterCommandMode();
+    showBlackMessage(tr("%n lines >ed %1 time", 0,
+        (cmd.endLine - cmd.beginLine + 1)).arg(1));
+}
+
+void EmacsKeysHandler::Private::exRedo(const ExCommand &) // :redo
+{
+    redo();
+    enterCommandMode();
+    updateMiniBuffer();
+}
+
+void EmacsKeysHandler::Private::exNormal(const ExCommand &cmd) // :normal
+{
+    enterCommandMode();
+    //qDebug() << "REPLAY: " << cmd.args;
+    replay(cmd.args, 1);
+}
+
+// :s/needle/replacement/flags with any delimiter, '\' escapes it
+// Splits the "/needle/replacement/flags" arguments of :s. An escaped
+// delimiter loses its backslash, other escapes are kept for the pattern
+// and the replacement.
+static void splitSubstitute(const QString &args, QString *needle,
+    QString *replacement, QString *flags)
+{
+    const QChar delimiter = args.at(0);
+    QStringList parts;
+    QString part;
+    int start = 1;
+    for (int i = 1, n = args.size(); i <= n && parts.size() < 2; ++i) {
+        if (i + 1 < n && args.at(i) == '\\' && args.at(i + 1) == delimiter) {
+            part += delimiter;
+            ++i;
+        } else if (i + 1 < n && args.at(i) == '\\') {
+            part += args.at(i);
+            part += args.at(++i);
+        } else if (i == n || args.at(i) == delimiter) {
+            parts.append(part);
+            part.clear();
+            start = i + 1;
         } else {
-            showRedMessage(tr("E512: Unknown option: ") + arg);
+            part += args.at(i);
         }
+    }
+    while (parts.size() < 2)
+        parts.append(QString());
+    *needle = parts.at(0);
+    *replacement = parts.at(1);
+    *flags = args.mid(start);
+}
+
+void EmacsKeysHandler::Private::exSubstitute(const ExCommand &cmd)
+{
+    if (cmd.args.isEmpty()) {
         enterCommandMode();
-        updateMiniBuffer();
-    } else if (reHistory.indexIn(cmd) != -1) { // :history
-        QString arg = reSet.cap(3);
-        if (arg.isEmpty()) {
-            QString info;
-            info += "#  command history\n";
-            int i = 0;
-            foreach (const QString &item, m_commandHistory) {
-                ++i;
-                info += QString("%1 %2\n").arg(i, -8).arg(item);
-            }
-            emit q->extraInformationChanged(info);
-        } else {
-            notImplementedYet();
-        }
+        showRedMessage(tr("E492: Not an editor command: ") + cmd.line);
+        return;
+    }
+    QString needle;
+    QString replacement;
+    QString flags;
+    splitSubstitute(cmd.args, &needle, &replacement, &flags);
+    const int beginLine = cmd.beginLine == -1
+        ? cursorLineInDocument() + 1 : cmd.beginLine;
+    const int endLine = cmd.endLine == -1 ? beginLine : cmd.endLine;
+
+    // the same scanner as :bufdo, on the text of the range
+    const int start = firstPositionInLine(beginLine);
+    m_tc.setPosition(start, MoveAnchor);
+    m_tc.setPosition(lastPositionInLine(endLine), KeepAnchor);
+    QString text = m_tc.selectedText();
+    text.replace(ParagraphSeparator, "\n");
+    const QList<SubstituteEdit> edits =
+        SubstituteScanner(needle, replacement, flags)(text);
+    if (edits.isEmpty()) {
+        m_tc.clearSelection();
         enterCommandMode();
-        updateMiniBuffer();
+        return;
+    }
+    // back to front, so the positions of the edits still to come hold
+    beginEditBlock();
+    int delta = 0;
+    for (int i = edits.size() - 1; i >= 0; --i) {
+        const SubstituteEdit &edit = edits.at(i);
+        m_tc.setPosition(start + edit.position, MoveAnchor);
+        m_tc.setPosition(start + edit.position + edit.length, KeepAnchor);
+        m_tc.insertText(edit.text);
+        if (i != edits.size() - 1)
+            delta += edit.text.size() - edit.length;
+    }
+    const SubstituteEdit &last = edits.last();
+    m_tc.setPosition(start + last.position + delta + last.text.size());
+    endEditBlock();
+    enterCommandMode();
+}
+
+// :bufdo s/needle/replacement/flags runs the substitute over the whole of
+// every open document. The plugin owns the documents and does the work.
+void EmacsKeysHandler::Private::exBufdo(const ExCommand &cmd)
+{
+    enterCommandMode();
+    ExCommand command;
+    parseExCommand(cmd.args, &command);
+    if (!command.info || command.info->handler != &Private::exSubstitute
+            || command.args.isEmpty()) {
+        showRedMessage(tr("E492: Only :substitute is supported by :bufdo: ")
+            + cmd.args);
+        return;
+    }
+    QString needle;
+    QString replacement;
+    QString flags;
+    splitSubstitute(command.args, &needle, &replacement, &flags);
+    showBlackMessage(tr("Substituting in all buffers..."));
+    emit q->substituteInBuffersRequested(needle, replacement, flags);
+}
+
+void EmacsKeysHandler::Private::exSet(const ExCommand &cmd) // :set
+{
+    showBlackMessage(QString());
+    const QString &arg = cmd.args;
+    SavedAction *act = theEmacsKeysSettings()->item(arg);
+    if (arg.isEmpty()) {
+        theEmacsKeysSetting(SettingsDialog)->trigger(QVariant());
+    } else if (act && act->value().type() == QVariant::Bool) {
+        // boolean config to be switched on
+        bool oldValue = act->value().toBool();
+        if (oldValue == false)
+            act->setValue(true);
+        else if (oldValue == true)
+            {} // nothing to do
+    } else if (act) {
+        // non-boolean to show
+        showBlackMessage(arg + '=' + act->value().toString());
+    } else if (arg.startsWith("no")
+            && (act = theEmacsKeysSettings()->item(arg.mid(2)))) {
+        // boolean config to be switched off
+        bool oldValue = act->value().toBool();
+        if (oldValue == true)
+            act->setValue(false);
+        else if (oldValue == false)
+            {} // nothing to do
+    } else if (arg.contains('=')) {
+        // non-boolean config to set
+        int p = arg.indexOf('=');
+        act = theEmacsKeysSettings()->item(arg.left(p));
+        if (act)
+            act->setValue(arg.mid(p + 1));
     } else {
-        enterCommandMode();
-        showRedMessage(tr("E492: Not an editor command: ") + cmd0);
+        showRedMessage(tr("E512: Unknown option: ") + arg);
+    }
+    enterCommandMode();
+    updateMiniBuffer();
+}
+
+void EmacsKeysHandler::Private::exHistory(const ExCommand &cmd) // :history
+{
+    if (cmd.args.isEmpty()) {
+        QString info;
+        info += "#  command history\n";
+        int i = 0;
+        foreach (const QString &item, m_commandHistory) {
+            ++i;
+            info += QString("%1 %2\n").arg(i, -8).arg(item);
+        }
+        emit q->extraInformationChanged(info);
+    } else {
+        notImplementedYet();
     }
+    enterCommandMode();
+    updateMiniBuffer();
 }
 
 static void vimPatternToQtPattern(QString *needle, QTextDocument::FindFlags *flags)
@@ -2267,7 +3481,7 @@ void EmacsKeysHandler::Private::search(const QString &needle0, bool forward)
 
 void EmacsKeysHandler::Private::highlightMatches(const QString &needle0)
 {
-    if (!hasConfig(ConfigHlSearch))
+    if (!config().hlSearch)
         return;
     if (needle0 == m_oldNeedle)
         return;
@@ -2331,59 +3545,484 @@ void EmacsKeysHandler::Private::indentRegion(QChar typedChar)
 
 void EmacsKeysHandler::Private::shiftRegionRight(int repeat)
 {
-    int beginLine = lineForPosition(anchor());
-    int endLine = lineForPosition(position());
-    if (beginLine > endLine)
-        qSwap(beginLine, endLine);
-    int len = config(ConfigShiftWidth).toInt() * repeat;
-    QString indent(len, ' ');
-    int firstPos = firstPositionInLine(beginLine);
+    int beginLine = lineForPosition(anchor());
+    int endLine = lineForPosition(position());
+    if (beginLine > endLine)
+        qSwap(beginLine, endLine);
+    indentLines(beginLine, endLine, config().shiftWidth * repeat);
+
+    setPosition(firstPositionInLine(beginLine));
+    moveToFirstNonBlankOnLine();
+    setTargetColumn();
+    setDotCommand("%1>>", endLine - beginLine + 1);
+}
+
+void EmacsKeysHandler::Private::shiftRegionLeft(int repeat)
+{
+    int beginLine = lineForPosition(anchor());
+    int endLine = lineForPosition(position());
+    if (beginLine > endLine)
+        qSwap(beginLine, endLine);
+    indentLines(beginLine, endLine, -config().shiftWidth * repeat);
+
+    setPosition(firstPositionInLine(beginLine));
+    moveToFirstNonBlankOnLine();
+    setTargetColumn();
+    setDotCommand("%1<<", endLine - beginLine + 1);
+}
+
+// Moves the text of the lines by columns. A tab counts up to the next tab
+// stop, and the new indentation is made of tabs and spaces unless
+// expandtab is set. Blank lines lose their indentation. Only the
+// indentation of each line is replaced, from the last line up, so marks
+// and block data of the lines stay, and all of it is one undo step.
+void EmacsKeysHandler::Private::indentLines(int beginLine, int endLine, int columns)
+{
+    const int tab = qMax(1, config().tabStop);
+    const bool expandTab = config().expandTab;
+    const QTextDocument *doc = m_tc.document();
+    const QTextBlock first = doc->findBlockByNumber(beginLine - 1);
+    const QTextBlock last = doc->findBlockByNumber(endLine - 1);
+    if (!first.isValid() || !last.isValid())
+        return;
+
+    beginEditBlock();
+    for (QTextBlock block = last; ; block = block.previous()) {
+        const QString line = block.text();
+        int column = 0;
+        int i = 0;
+        for (; i != line.size(); ++i) {
+            if (line.at(i) == ' ')
+                ++column;
+            else if (line.at(i) == '\t')
+                column += tab - column % tab;
+            else
+                break;
+        }
+        QString indent;
+        if (i != line.size()) {
+            const int newColumn = qMax(0, column + columns);
+            if (expandTab) {
+                indent = QString(newColumn, ' ');
+            } else {
+                indent = QString(newColumn / tab, '\t');
+                indent += QString(newColumn % tab, ' ');
+            }
+        }
+        if (indent != line.left(i)) {
+            m_tc.setPosition(block.position(), MoveAnchor);
+            m_tc.setPosition(block.position() + i, KeepAnchor);
+            m_tc.insertText(indent);
+        }
+        if (block == first)
+            break;
+    }
+    endEditBlock();
+}
+
+// Splits text, which starts at visual column startColumn, at column. A tab
+// that straddles the column is turned into spaces on both sides. Returns
+// the column where before ends, which is less than column if the text is
+// too short.
+static int splitAtColumn(const QString &text, int startColumn, int column,
+    int tab, QString *before, QString *after)
+{
+    int col = startColumn;
+    int i = 0;
+    for (; i != text.size() && col < column; ++i) {
+        const int width = text.at(i) == '\t' ? tab - col % tab : 1;
+        if (col + width > column) {
+            *before = text.left(i) + QString(column - col, ' ');
+            *after = QString(col + width - column, ' ') + text.mid(i + 1);
+            return column;
+        }
+        col += width;
+    }
+    *before = text.left(i);
+    *after = text.mid(i);
+    return col;
+}
+
+static int visualColumn(const QString &line, int index, int tab)
+{
+    int column = 0;
+    for (int i = 0; i != index && i != line.size(); ++i)
+        column += line.at(i) == '\t' ? tab - column % tab : 1;
+    return column;
+}
+
+// The rectangle has the mark and point at opposite corners. Columns are
+// visual columns, endColumn is exclusive.
+bool EmacsKeysHandler::Private::rectangleBounds(int *beginLine, int *endLine,
+    int *startColumn, int *endColumn)
+{
+    Mark mark(markRing.getMostRecentMark());
+    if (!mark.valid) {
+        QApplication::beep();
+        showBlackMessage(tr("The mark is not set now"));
+        return false;
+    }
+    const int tab = qMax(1, config().tabStop);
+    const QTextDocument *doc = m_tc.document();
+    const QTextBlock markBlock = doc->findBlock(mark.position);
+    const QTextBlock pointBlock = m_tc.block();
+    const int markColumn = visualColumn(markBlock.text(),
+        mark.position - markBlock.position(), tab);
+    const int pointColumn = visualColumn(pointBlock.text(),
+        position() - pointBlock.position(), tab);
+    *beginLine = qMin(markBlock.blockNumber(), pointBlock.blockNumber()) + 1;
+    *endLine = qMax(markBlock.blockNumber(), pointBlock.blockNumber()) + 1;
+    *startColumn = qMin(markColumn, pointColumn);
+    *endColumn = qMax(markColumn, pointColumn);
+    return true;
+}
+
+// Replaces the columns startColumn to endColumn of the lines beginLine to
+// endLine (1 based) with the strings of replacement, one per line, and
+// returns what was there, padded to the width of the rectangle. Lines
+// past the end of the document are added. The blocks are walked once by
+// column, then each line is edited only where it changes, from the last
+// line up and in one edit block. Point ends up after the replacement on
+// the last line, or on the first line if atStart is set.
+QStringList EmacsKeysHandler::Private::replaceRectangle(int beginLine,
+    int endLine, int startColumn, int endColumn,
+    const QStringList &replacement, bool atStart)
+{
+    const int tab = qMax(1, config().tabStop);
+    const QTextDocument *doc = m_tc.document();
+    const QTextBlock first = doc->findBlockByNumber(beginLine - 1);
+    if (!first.isValid())
+        return QStringList();
+
+    QStringList removed;
+    QStringList newLines;
+    int cornerLine = beginLine;
+    int cornerOffset = 0;
+    QTextBlock block = first;
+    for (int line = beginLine; line <= endLine; ++line) {
+        const QString insert = replacement.value(line - beginLine);
+        const QString oldLine = block.isValid() ? block.text() : QString();
+        QString before, rest, middle, after;
+        const int reached = splitAtColumn(oldLine, 0, startColumn, tab,
+            &before, &rest);
+        const int middleEnd = splitAtColumn(rest, reached, endColumn, tab,
+            &middle, &after);
+        removed.append(middle
+            + QString(endColumn - qMax(middleEnd, startColumn), ' '));
+
+        QString newLine;
+        if (reached < startColumn && insert.isEmpty()) {
+            // nothing to remove or insert, don't pad the line
+            newLine = oldLine;
+            if (!atStart || line == beginLine) {
+                cornerLine = line;
+                cornerOffset = newLine.size();
+            }
+        } else {
+            newLine = before;
+            newLine += QString(startColumn - reached, ' ');
+            newLine += insert;
+            if (!atStart || line == beginLine) {
+                cornerLine = line;
+                cornerOffset = newLine.size() - (atStart ? insert.size() : 0);
+            }
+            newLine += after;
+        }
+        newLines.append(newLine);
+        if (block.isValid())
+            block = block.next();
+    }
+
+    beginEditBlock();
+    QString added;
+    int line = endLine;
+    for (; line > beginLine && !doc->findBlockByNumber(line - 1).isValid();
+            --line)
+        added.prepend('\n' + newLines.at(line - beginLine));
+    if (!added.isEmpty()) {
+        m_tc.setPosition(doc->characterCount() - 1, MoveAnchor);
+        m_tc.insertText(added);
+    }
+    for (block = doc->findBlockByNumber(line - 1); ; block = block.previous()) {
+        const QString oldLine = block.text();
+        const QString &newLine = newLines.at(line - beginLine);
+        const int common = qMin(oldLine.size(), newLine.size());
+        int prefix = 0;
+        while (prefix != common && oldLine.at(prefix) == newLine.at(prefix))
+            ++prefix;
+        int suffix = 0;
+        while (suffix != common - prefix
+                && oldLine.at(oldLine.size() - 1 - suffix)
+                    == newLine.at(newLine.size() - 1 - suffix))
+            ++suffix;
+        if (prefix + suffix != oldLine.size()
+                || prefix + suffix != newLine.size()) {
+            m_tc.setPosition(block.position() + prefix, MoveAnchor);
+            m_tc.setPosition(block.position() + oldLine.size() - suffix,
+                KeepAnchor);
+            m_tc.insertText(newLine.mid(prefix,
+                newLine.size() - prefix - suffix));
+        }
+        if (line == beginLine)
+            break;
+        --line;
+    }
+    endEditBlock();
+    setPosition(doc->findBlockByNumber(cornerLine - 1).position()
+        + cornerOffset);
+    setTargetColumn();
+    return removed;
+}
+
+// C-x r k
+void EmacsKeysHandler::Private::killRectangle()
+{
+    int beginLine, endLine, startColumn, endColumn;
+    if (!rectangleBounds(&beginLine, &endLine, &startColumn, &endColumn))
+        return;
+    m_killedRectangle = replaceRectangle(beginLine, endLine, startColumn,
+        endColumn, QStringList(), true);
+}
+
+// C-x r y, inserts the last killed rectangle with its upper left corner
+// at point.
+void EmacsKeysHandler::Private::yankRectangle()
+{
+    if (m_killedRectangle.isEmpty()) {
+        QApplication::beep();
+        showBlackMessage(tr("No rectangle has been killed"));
+        return;
+    }
+    const int tab = qMax(1, config().tabStop);
+    const int line = cursorLineInDocument() + 1;
+    const int column = visualColumn(m_tc.block().text(), leftDist(), tab);
+    markRing.addMark(position());
+    replaceRectangle(line, line + m_killedRectangle.size() - 1, column,
+        column, m_killedRectangle, false);
+}
+
+// C-x r t, reads the string that replaces every line of the rectangle.
+void EmacsKeysHandler::Private::stringRectangle()
+{
+    int beginLine, endLine, startColumn, endColumn;
+    if (!rectangleBounds(&beginLine, &endLine, &startColumn, &endColumn))
+        return;
+    enterExMode();
+    m_mode = StringRectangleMode;
+    m_currentMessage.clear();
+    m_commandBuffer.clear();
+    updateMiniBuffer();
+}
+
+void EmacsKeysHandler::Private::finishStringRectangle(const QString &string)
+{
+    int beginLine, endLine, startColumn, endColumn;
+    if (!rectangleBounds(&beginLine, &endLine, &startColumn, &endColumn))
+        return;
+    QStringList lines;
+    for (int i = beginLine; i <= endLine; ++i)
+        lines.append(string);
+    replaceRectangle(beginLine, endLine, startColumn, endColumn, lines, false);
+}
+
+// C-x TAB, moves the lines between mark and point by count() columns.
+// Point stays on the same character.
+void EmacsKeysHandler::Private::indentRigidly()
+{
+    Mark mark(markRing.getMostRecentMark());
+    if (!mark.valid) {
+        QApplication::beep();
+        showBlackMessage(tr("The mark is not set now"));
+        return;
+    }
+    const int begin = qMin(mark.position, position());
+    const int end = qMax(mark.position, position());
+    const int beginLine = lineForPosition(begin);
+    int endLine = lineForPosition(end);
+    // a region that ends at the start of a line does not include it
+    if (endLine > beginLine && end == firstPositionInLine(endLine))
+        --endLine;
+
+    const int line = cursorLineInDocument();
+    const int fromEnd = rightDist();
+    indentLines(beginLine, endLine, count());
+
+    const QTextBlock block = m_tc.document()->findBlockByNumber(line);
+    setPosition(block.position() + qMax(0, block.length() - 1 - fromEnd));
+    setTargetColumn();
+}
+
+void EmacsKeysHandler::Private::startKbdMacro()
+{
+    if (m_recordingMacro) {
+        QApplication::beep();
+        showBlackMessage(tr("Already defining kbd macro"));
+        return;
+    }
+    m_recordingMacro = true;
+    m_macro.clear();
+    showBlackMessage(tr("Defining kbd macro..."));
+}
+
+void EmacsKeysHandler::Private::endKbdMacro()
+{
+    if (!m_recordingMacro) {
+        QApplication::beep();
+        showBlackMessage(tr("Not defining kbd macro"));
+        return;
+    }
+    m_recordingMacro = false;
+    m_lastMacro = m_macro;
+    m_macro.clear();
+    showBlackMessage(tr("Keyboard macro defined"));
+}
+
+void EmacsKeysHandler::Private::callLastKbdMacro()
+{
+    // like Emacs, C-x e while recording ends the macro first
+    if (m_recordingMacro)
+        endKbdMacro();
+    if (m_lastMacro.isEmpty()) {
+        QApplication::beep();
+        showBlackMessage(tr("No kbd macro has been defined"));
+        return;
+    }
+    const int times = m_argumentState == NoArgument ? 1 : count();
+    m_argumentState = NoArgument;
+    m_mvcount.clear();
+    executeMacro(m_lastMacro, times);
+}
+
+void EmacsKeysHandler::Private::recordMacroStep(QKeyEvent *ev, EventResult result)
+{
+    const QString text = ev->text();
+    const bool selfInsert = result == EventUnhandled && text.size() == 1
+        && (text.at(0).isLetterOrNumber() || text.at(0) == ' ')
+        && (ev->modifiers() & (Qt::ControlModifier | Qt::AltModifier)) == 0;
+    if (selfInsert) {
+        if (!m_macro.isEmpty() && m_macro.last().kind == MacroStep::Text) {
+            m_macro.last().text += text;
+            return;
+        }
+        MacroStep step = { MacroStep::Text, 0, 0, text };
+        m_macro.append(step);
+        return;
+    }
+    MacroStep step = { MacroStep::Key, ev->key(), int(ev->modifiers()), text };
+    m_macro.append(step);
+}
+
+// Plays the macro back on m_tc as one undo step. Minibuffer and selection
+// are updated once at the end, and keys no command handles are passed to
+// the editor directly, bypassing our event filter.
+void EmacsKeysHandler::Private::executeMacro(const QVector<MacroStep> &macro,
+    int times)
+{
+    const bool wasBatchMode = m_batchMode;
+    m_batchMode = true;
+    beginEditBlock();
+    for (int n = 0; n != times; ++n)
+        runMacroSteps(macro);
+    endEditBlock();
+    m_batchMode = wasBatchMode;
 
-    for (int line = beginLine; line <= endLine; ++line) {
-        setPosition(firstPositionInLine(line));
-        m_tc.insertText(indent);
+    if (!m_batchMode) {
+        updateSelection();
+        updateMiniBuffer();
     }
-
-    setPosition(firstPos);
-    moveToFirstNonBlankOnLine();
-    setTargetColumn();
-    setDotCommand("%1>>", endLine - beginLine + 1);
 }
 
-void EmacsKeysHandler::Private::shiftRegionLeft(int repeat)
+void EmacsKeysHandler::Private::runMacroSteps(const QVector<MacroStep> &macro)
 {
-    int beginLine = lineForPosition(anchor());
-    int endLine = lineForPosition(position());
-    if (beginLine > endLine)
-        qSwap(beginLine, endLine);
-    int shift = config(ConfigShiftWidth).toInt() * repeat;
-    int tab = config(ConfigTabStop).toInt();
-    int firstPos = firstPositionInLine(beginLine);
-
-    for (int line = beginLine; line <= endLine; ++line) {
-        int pos = firstPositionInLine(line);
-        setPosition(pos);
-        setAnchor(pos);
-        QString text = m_tc.block().text();
-        int amount = 0;
-        int i = 0;
-        for (; i < text.size() && amount <= shift; ++i) {
-            if (text.at(i) == ' ')
-                amount++;
-            else if (text.at(i) == '\t')
-                amount += tab; // FIXME: take position into consideration
-            else
-                break;
+    for (int i = 0; i != macro.size(); ++i) {
+        const MacroStep &step = macro.at(i);
+        switch (step.kind) {
+        case MacroStep::Text:
+            m_tc.insertText(step.text);
+            break;
+        case MacroStep::Command:
+            (this->*emacsCommand(step.text))();
+            m_argumentState = NoArgument;
+            m_mvcount.clear();
+            break;
+        case MacroStep::Key: {
+            QKeyEvent ev(QEvent::KeyPress, step.key,
+                Qt::KeyboardModifiers(step.modifiers), step.text);
+            if (dispatchKey(&ev) == EventUnhandled) {
+                commitCursor();
+                static_cast<QObject *>(editor())->event(&ev);
+                m_tc = EDITOR(textCursor());
+                m_oldTc = m_tc;
+            }
+            break;
+        }
         }
-        setPosition(pos + i);
-        text = removeSelectedText();
-        setPosition(pos);
     }
+}
 
-    setPosition(firstPos);
-    moveToFirstNonBlankOnLine();
-    setTargetColumn();
-    setDotCommand("%1<<", endLine - beginLine + 1);
+// Runs the last macro at the start of every line of the region. Two
+// cursors track the next line and the last one while the macro edits the
+// text; keeping more, one per line, would slow down every edit.
+//
+// Only text runs and our own commands are batched. A key only the editor
+// handles, like Backspace or a brace, needs the cursor committed and goes
+// through the editor's event() on every line, so macros made of those run
+// at the speed of typing them.
+void EmacsKeysHandler::Private::applyMacroToRegionLines()
+{
+    if (m_recordingMacro)
+        endKbdMacro();
+    if (m_lastMacro.isEmpty()) {
+        QApplication::beep();
+        showBlackMessage(tr("No kbd macro has been defined"));
+        return;
+    }
+    Mark mark(markRing.getMostRecentMark());
+    if (!mark.valid) {
+        QApplication::beep();
+        showBlackMessage(tr("The mark is not set now"));
+        return;
+    }
+    const int begin = qMin(mark.position, position());
+    const int end = qMax(mark.position, position());
+    QTextCursor next(m_tc.document());
+    next.setPosition(begin);
+    next.movePosition(QTextCursor::StartOfBlock);
+    QTextCursor last(m_tc.document());
+    last.setPosition(end);
+    // a region that ends at the start of a line does not include it
+    if (last.atBlockStart() && last.blockNumber() > next.blockNumber())
+        last.movePosition(QTextCursor::PreviousBlock);
+    last.movePosition(QTextCursor::StartOfBlock);
+
+    const bool wasBatchMode = m_batchMode;
+    m_batchMode = true;
+    beginEditBlock();
+    int lines = 0;
+    for (;;) {
+        const int line = next.blockNumber();
+        const bool isLast = line >= last.blockNumber()
+            || !next.block().next().isValid();
+        m_tc.setPosition(next.position());
+        next.movePosition(QTextCursor::NextBlock);
+        runMacroSteps(m_lastMacro);
+        ++lines;
+        if (isLast)
+            break;
+        // the macro may have typed at the start of the next line or
+        // joined it with this one
+        next.movePosition(QTextCursor::StartOfBlock);
+        if (next.blockNumber() <= line
+                && !next.movePosition(QTextCursor::NextBlock))
+            break;
+    }
+    endEditBlock();
+    m_batchMode = wasBatchMode;
+
+    if (!m_batchMode) {
+        updateSelection();
+        showBlackMessage(tr("Macro applied to %n lines", 0, lines));
+    }
 }
 
 void EmacsKeysHandler::Private::moveToTargetColumn()
@@ -2438,39 +4077,448 @@ void EmacsKeysHandler::Private::moveToWordBoundary(bool simple, bool forward)
     setTargetColumn();
 }
 
+// Returns the position of the count'th occurrence of c from offset
+// characters after (or before) pos on, or -1 if there is none. Scans whole
+// block texts with indexOf() instead of asking the document for one
+// character at a time.
+static int findCharacter(const QTextDocument *doc, int pos, int offset,
+    QChar c, int count, bool forward, bool stayInLine)
+{
+    QTextBlock block = doc->findBlock(pos);
+    int from = pos - block.position() + (forward ? offset : -offset);
+    while (block.isValid()) {
+        const QString text = block.text();
+        int i = -1;
+        if (forward)
+            i = text.indexOf(c, from);
+        else if (from >= 0)
+            i = text.lastIndexOf(c, from);
+        while (i != -1) {
+            if (--count == 0)
+                return block.position() + i;
+            if (forward)
+                i = text.indexOf(c, i + 1);
+            else
+                i = i == 0 ? -1 : text.lastIndexOf(c, i - 1);
+        }
+        if (stayInLine)
+            break;
+        block = forward ? block.next() : block.previous();
+        from = forward ? 0 : block.length() - 2;
+    }
+    return -1;
+}
+
 void EmacsKeysHandler::Private::handleFfTt(int key)
 {
     // m_subsubmode \in { 'f', 'F', 't', 'T' }
     bool forward = m_subsubdata == 'f' || m_subsubdata == 't';
-    int repeat = count();
-    QTextDocument *doc = m_tc.document();
-    QTextBlock block = m_tc.block();
-    int n = block.position();
-    if (forward)
-        n += block.length();
-    int pos = m_tc.position();
-    while (true) {
-        pos += forward ? 1 : -1;
-        if (pos == n)
-            break;
-        int uc = doc->characterAt(pos).unicode();
-        if (uc == ParagraphSeparator)
-            break;
-        if (uc == key)
-            --repeat;
-        if (repeat == 0) {
-            if (m_subsubdata == 't')
-                --pos;
-            else if (m_subsubdata == 'T')
-                ++pos;
+    int pos = findCharacter(m_tc.document(), m_tc.position(), 1, QChar(key),
+        count(), forward, true);
+    if (pos != -1) {
+        if (m_subsubdata == 't')
+            --pos;
+        else if (m_subsubdata == 'T')
+            ++pos;
+        m_tc.setPosition(pos, KeepAnchor);
+    }
+    setTargetColumn();
+}
 
-            if (forward)
-                m_tc.movePosition(Right, KeepAnchor, pos - m_tc.position());
-            else
-                m_tc.movePosition(Left, KeepAnchor, m_tc.position() - pos);
-            break;
+// M-z kills up to and including the character, C-c f puts point after
+// it and C-c b on it, like search-forward and search-backward.
+void EmacsKeysHandler::Private::handleCharCommand(int key, const QString &text)
+{
+    const CharCommand command = m_charCommand;
+    m_charCommand = NoCharCommand;
+    showBlackMessage(QString());
+    if (key == Key_Escape || text.isEmpty() || !text.at(0).isPrint()) {
+        QApplication::beep();
+        return;
+    }
+
+    const QChar c = text.at(0);
+    if (command >= CopyToRegisterCommand) {
+        handleRegisterCommand(command, c);
+        return;
+    }
+    // the character at point counts going forward, the one before it going
+    // backward
+    const bool forward = command != CharSearchBackwardCommand;
+    const int pos = findCharacter(m_tc.document(), position(),
+        forward ? 0 : 1, c, count(), forward, false);
+    if (pos == -1) {
+        QApplication::beep();
+        showBlackMessage(tr("Search failed: \"%1\"").arg(c));
+        return;
+    }
+
+    if (command == ZapToCharCommand) {
+        beginEditBlock();
+        m_tc.setPosition(pos + 1, KeepAnchor);
+        QApplication::clipboard()->setText(m_tc.selectedText());
+        m_tc.removeSelectedText();
+        endEditBlock();
+    } else {
+        setPosition(forward ? pos + 1 : pos);
+    }
+    setTargetColumn();
+}
+
+// The register commands read the name of the register as the next key,
+// see handleRegisterCommand(). The C-u count given before the command is
+// kept for when the name arrives.
+void EmacsKeysHandler::Private::copyToRegister()
+{
+    m_charCommand = CopyToRegisterCommand;
+    m_registerCount = count();
+    m_registerArgument = m_argumentState != NoArgument || !m_mvcount.isEmpty();
+    showBlackMessage(tr("Copy to register: "));
+}
+
+void EmacsKeysHandler::Private::insertRegister()
+{
+    m_charCommand = InsertRegisterCommand;
+    showBlackMessage(tr("Insert register: "));
+}
+
+void EmacsKeysHandler::Private::pointToRegister()
+{
+    m_charCommand = PointToRegisterCommand;
+    showBlackMessage(tr("Point to register: "));
+}
+
+void EmacsKeysHandler::Private::jumpToRegister()
+{
+    m_charCommand = JumpToRegisterCommand;
+    showBlackMessage(tr("Jump to register: "));
+}
+
+void EmacsKeysHandler::Private::numberToRegister()
+{
+    m_charCommand = NumberToRegisterCommand;
+    m_registerCount = m_mvcount.isEmpty() ? 0 : count();
+    showBlackMessage(tr("Number to register: "));
+}
+
+void EmacsKeysHandler::Private::incrementRegister()
+{
+    m_charCommand = IncrementRegisterCommand;
+    m_registerCount = count();
+    showBlackMessage(tr("Increment register: "));
+}
+
+void EmacsKeysHandler::Private::handleRegisterCommand(CharCommand command,
+    QChar name)
+{
+    Registers *registers = Registers::instance();
+    const Registers::Register reg = registers->get(name);
+
+    switch (command) {
+    case CopyToRegisterCommand: {
+        Mark mark(markRing.getMostRecentMark());
+        if (!mark.valid) {
+            QApplication::beep();
+            showBlackMessage(tr("The mark is not set now"));
+            return;
+        }
+        QTextCursor tc = m_tc;
+        tc.setPosition(mark.position, KeepAnchor);
+        if (!registers->setText(name, tc.selection().toPlainText())) {
+            QApplication::beep();
+            showBlackMessage(tr("Registers cannot hold more than %n characters",
+                0, Registers::maxTotalSize));
+            return;
+        }
+        // C-u C-x r s deletes the region, too, whatever the count
+        if (m_registerArgument)
+            tc.removeSelectedText();
+        break;
+    }
+    case InsertRegisterCommand: {
+        if (reg.type != Registers::Register::Text
+                && reg.type != Registers::Register::Number) {
+            QApplication::beep();
+            showBlackMessage(tr("Register does not contain text"));
+            return;
+        }
+        // like Emacs, point stays before the text and the mark goes after it
+        const int pos = position();
+        if (reg.type == Registers::Register::Text)
+            m_tc.insertText(reg.text);
+        else
+            m_tc.insertText(QString::number(reg.value));
+        markRing.addMark(position());
+        setPosition(pos);
+        setTargetColumn();
+        break;
+    }
+    case PointToRegisterCommand:
+        registers->setPoint(name, m_currentFileName, m_tc);
+        break;
+    case JumpToRegisterCommand:
+        if (reg.type != Registers::Register::Point) {
+            QApplication::beep();
+            showBlackMessage(tr("Register doesn't contain a buffer position"));
+            return;
+        }
+        if (reg.text != m_currentFileName) {
+            QApplication::beep();
+            showBlackMessage(tr("Register is a position in %1").arg(reg.text));
+            return;
+        }
+        markRing.addMark(position());
+        setPosition(qMin(int(reg.value), m_tc.document()->characterCount() - 1));
+        setTargetColumn();
+        break;
+    case NumberToRegisterCommand:
+        registers->setNumber(name, m_registerCount);
+        break;
+    case IncrementRegisterCommand:
+        if (reg.type != Registers::Register::Number
+                && reg.type != Registers::Register::Empty) {
+            QApplication::beep();
+            showBlackMessage(tr("Register does not contain a number"));
+            return;
+        }
+        registers->setNumber(name, reg.value + m_registerCount);
+        break;
+    default:
+        break;
+    }
+}
+
+// Collects the matches from point to the end of the document in one pass
+// over its blocks. They are asked about in order, each shifted by how much
+// the replacements before it changed the length of the text.
+void EmacsKeysHandler::Private::startQueryReplace()
+{
+    // like case-fold-search, all lower case text matches either case
+    const Qt::CaseSensitivity cs = m_queryFrom.toLower() == m_queryFrom
+        ? Qt::CaseInsensitive : Qt::CaseSensitive;
+    QRegExp pattern(m_queryFrom, cs);
+    if (m_queryRegExp && !pattern.isValid()) {
+        enterCommandMode();
+        QApplication::beep();
+        showBlackMessage(tr("Invalid regexp: %1").arg(pattern.errorString()));
+        return;
+    }
+
+    m_queryMatches.clear();
+    QTextBlock block = m_tc.document()->findBlock(position());
+    int from = position() - block.position();
+    for (; block.isValid(); block = block.next(), from = 0) {
+        const QString text = block.text();
+        QueryReplaceMatch match;
+        while (from <= text.size()) {
+            int i;
+            if (m_queryRegExp) {
+                i = pattern.indexIn(text, from);
+                match.length = pattern.matchedLength();
+                match.captures = pattern.capturedTexts();
+            } else {
+                i = text.indexOf(m_queryFrom, from, cs);
+                match.length = m_queryFrom.size();
+            }
+            if (i == -1)
+                break;
+            match.position = block.position() + i;
+            m_queryMatches.append(match);
+            // an empty match must not be found again
+            from = i + qMax(match.length, 1);
+        }
+    }
+
+    setMark();
+    m_queryIndex = 0;
+    m_queryOffset = 0;
+    m_queryReplaced = 0;
+    m_queryRevision = m_tc.document()->revision();
+    m_mode = QueryReplaceMode;
+    showQueryMatch();
+}
+
+// y or SPC replaces the match and n or DEL skips it, ! replaces all that
+// are left and . replaces this one and stops. Other keys stop right away.
+void EmacsKeysHandler::Private::handleQueryReplaceKey(int key, const QString &text)
+{
+    // the matches are stale if the document was changed behind our back
+    if (m_tc.document()->revision() != m_queryRevision) {
+        finishQueryReplace();
+        return;
+    }
+
+    const QChar c = text.isEmpty() ? QChar() : text.at(0);
+    if (c == 'y' || key == Key_Space) {
+        replaceQueryMatch();
+        showQueryMatch();
+    } else if (c == 'n' || key == Key_Backspace || key == Key_Delete) {
+        ++m_queryIndex;
+        showQueryMatch();
+    } else if (c == '!') {
+        replaceRemainingQueryMatches();
+        finishQueryReplace();
+    } else if (c == '.') {
+        replaceQueryMatch();
+        finishQueryReplace();
+    } else {
+        finishQueryReplace();
+    }
+}
+
+void EmacsKeysHandler::Private::showQueryMatch()
+{
+    if (m_queryIndex == m_queryMatches.size()) {
+        finishQueryReplace();
+        return;
+    }
+    const QueryReplaceMatch &match = m_queryMatches.at(m_queryIndex);
+    m_tc.setPosition(match.position + m_queryOffset, MoveAnchor);
+    m_tc.setPosition(match.position + m_queryOffset + match.length, KeepAnchor);
+    updateMiniBuffer();
+}
+
+QString EmacsKeysHandler::Private::queryReplacement(
+    const QueryReplaceMatch &match) const
+{
+    if (!m_queryRegExp)
+        return m_queryTo;
+    QString result;
+    for (int i = 0, n = m_queryTo.size(); i != n; ++i) {
+        const QChar c = m_queryTo.at(i);
+        if (c != '\\' || i + 1 == n) {
+            result += c;
+            continue;
+        }
+        const QChar next = m_queryTo.at(++i);
+        if (next == '&')
+            result += match.captures.value(0);
+        else if (next.isDigit())
+            result += match.captures.value(next.digitValue());
+        else
+            result += next;
+    }
+    return result;
+}
+
+void EmacsKeysHandler::Private::replaceQueryMatch()
+{
+    const QueryReplaceMatch &match = m_queryMatches.at(m_queryIndex);
+    const QString text = queryReplacement(match);
+    beginEditBlock();
+    m_tc.setPosition(match.position + m_queryOffset, MoveAnchor);
+    m_tc.setPosition(match.position + m_queryOffset + match.length, KeepAnchor);
+    m_tc.insertText(text);
+    endEditBlock();
+    m_queryOffset += text.size() - match.length;
+    m_queryRevision = m_tc.document()->revision();
+    ++m_queryReplaced;
+    ++m_queryIndex;
+}
+
+// Replaces the current match and all after it, from the last one back,
+// so the positions of the ones still to do stay valid. All of them are one
+// edit block, so the document is laid out once rather than once per match,
+// and the text between the matches is left alone.
+void EmacsKeysHandler::Private::replaceRemainingQueryMatches()
+{
+    if (m_queryIndex == m_queryMatches.size())
+        return;
+    const QueryReplaceMatch &last = m_queryMatches.last();
+    const int end = last.position + last.length;
+
+    beginEditBlock();
+    int delta = 0;
+    for (int i = m_queryMatches.size() - 1; i >= m_queryIndex; --i) {
+        const QueryReplaceMatch &match = m_queryMatches.at(i);
+        const QString replacement = queryReplacement(match);
+        m_tc.setPosition(match.position + m_queryOffset, MoveAnchor);
+        m_tc.setPosition(match.position + match.length + m_queryOffset,
+            KeepAnchor);
+        m_tc.insertText(replacement);
+        delta += replacement.size() - match.length;
+        ++m_queryReplaced;
+    }
+    m_queryIndex = m_queryMatches.size();
+    m_queryOffset += delta;
+    m_tc.setPosition(end + m_queryOffset, MoveAnchor);
+    endEditBlock();
+    m_queryRevision = m_tc.document()->revision();
+}
+
+void EmacsKeysHandler::Private::finishQueryReplace()
+{
+    m_tc.clearSelection();
+    m_queryMatches.clear();
+    enterCommandMode();
+    setTargetColumn();
+    showBlackMessage(tr("Replaced %n occurrence(s)", 0, m_queryReplaced));
+}
+
+// Expands the word before point to the nearest word that starts with it,
+// looking backward first, then forward, then in the other documents,
+// most frequent words first. Repeating M-/ right away replaces the
+// expansion with the next one, and finally with the original prefix.
+void EmacsKeysHandler::Private::dabbrevExpand()
+{
+    QTextDocument *doc = m_tc.document();
+    const bool again = m_dabbrevRevision == doc->revision()
+        && m_dabbrevIndex >= 0 && m_dabbrevStart
+            + m_dabbrevExpansions.at(m_dabbrevIndex).size() == position();
+    if (!again) {
+        const QTextBlock block = m_tc.block();
+        const QString text = block.text();
+        const int column = position() - block.position();
+        int start = column;
+        while (start > 0 && WordIndex::isWordCharacter(text.at(start - 1)))
+            --start;
+        m_dabbrevPrefix = text.mid(start, column - start);
+        m_dabbrevStart = block.position() + start;
+        m_dabbrevIndex = -1;
+        m_dabbrevExpansions.clear();
+        if (!m_dabbrevPrefix.isEmpty()) {
+            WordIndex *index = WordIndex::forDocument(doc);
+            m_dabbrevExpansions = index->expansions(m_dabbrevPrefix,
+                block.blockNumber(), column);
+            // documents without an index get one now, so their words
+            // show up once it was built
+            QList<QTextDocument *> documents;
+            emit q->openDocumentsRequested(&documents);
+            foreach (QTextDocument *document, documents) {
+                WordIndex *other = WordIndex::forDocument(document);
+                if (other == index)
+                    continue;
+                foreach (const QString &word, other->wordsWithPrefix(m_dabbrevPrefix))
+                    if (!m_dabbrevExpansions.contains(word))
+                        m_dabbrevExpansions.append(word);
+            }
         }
     }
+
+    const QString current = m_dabbrevIndex == -1
+        ? m_dabbrevPrefix : m_dabbrevExpansions.at(m_dabbrevIndex);
+    ++m_dabbrevIndex;
+    QString next;
+    if (m_dabbrevIndex == m_dabbrevExpansions.size()) {
+        next = m_dabbrevPrefix;
+        m_dabbrevIndex = -1;
+        QApplication::beep();
+        showBlackMessage(again
+            ? tr("No further dynamic expansion for \"%1\" found").arg(m_dabbrevPrefix)
+            : tr("No dynamic expansion for \"%1\" found").arg(m_dabbrevPrefix));
+    } else {
+        next = m_dabbrevExpansions.at(m_dabbrevIndex);
+        showBlackMessage(QString());
+    }
+
+    if (next != current) {
+        beginEditBlock();
+        m_tc.setPosition(m_dabbrevStart, MoveAnchor);
+        m_tc.setPosition(m_dabbrevStart + current.size(), KeepAnchor);
+        m_tc.insertText(next);
+        endEditBlock();
+    }
+    m_dabbrevRevision = doc->revision();
     setTargetColumn();
 }
 
@@ -2509,29 +4557,50 @@ void EmacsKeysHandler::Private::moveToMatchingParanthesis()
     setTargetColumn();
 }
 
+const ScreenGeometry &EmacsKeysHandler::Private::screenGeometry() const
+{
+    ScreenGeometry &geo = m_screenGeometry;
+    if (geo.valid || !editor())
+        return geo;
+    const QFontMetrics fm(EDITOR(font()));
+    const QWidget *view = viewport();
+    geo.lineHeight = qMax(1, fm.lineSpacing());
+    geo.charWidth = qMax(1, fm.width(QLatin1Char('x')));
+    geo.lines = qMax(1, view->height() / geo.lineHeight);
+    geo.columns = qMax(1, view->width() / geo.charWidth);
+    geo.valid = true;
+    return geo;
+}
+
+int EmacsKeysHandler::Private::firstVisibleLine() const
+{
+    if (!editor())
+        return 0;
+    // the block at the top of the viewport; the scroll bar value counts
+    // visible lines, which folded blocks make differ from block numbers
+    // (QPlainTextEdit::firstVisibleBlock() is protected)
+    return EDITOR(cursorForPosition(QPoint(0, 0))).blockNumber();
+}
+
 int EmacsKeysHandler::Private::cursorLineOnScreen() const
 {
     if (!editor())
         return 0;
-    QRect rect = EDITOR(cursorRect());
-    return rect.y() / rect.height();
+    return cursorLineInDocument() - firstVisibleLine();
 }
 
 int EmacsKeysHandler::Private::linesOnScreen() const
 {
     if (!editor())
         return 1;
-    QRect rect = EDITOR(cursorRect());
-    return EDITOR(height()) / rect.height();
+    return screenGeometry().lines;
 }
 
 int EmacsKeysHandler::Private::columnsOnScreen() const
 {
     if (!editor())
         return 1;
-    QRect rect = EDITOR(cursorRect());
-    // qDebug() << "WID: " << EDITOR(width()) << "RECT: " << rect;
-    return EDITOR(width()) / rect.width();
+    return screenGeometry().columns;
 }
 
 int EmacsKeysHandler::Private::cursorLineInDocument() const
@@ -2551,10 +4620,12 @@ int EmacsKeysHandler::Private::linesInDocument() const
 
 void EmacsKeysHandler::Private::scrollToLineInDocument(int line)
 {
-    // FIXME: works only for QPlainTextEdit
     QScrollBar *scrollBar = EDITOR(verticalScrollBar());
     //qDebug() << "SCROLL: " << scrollBar->value() << line;
-    scrollBar->setValue(line);
+    if (m_plaintextedit)
+        scrollBar->setValue(line);
+    else
+        scrollBar->setValue(line * screenGeometry().lineHeight);
 }
 
 void EmacsKeysHandler::Private::scrollUp(int count)
@@ -2562,6 +4633,21 @@ void EmacsKeysHandler::Private::scrollUp(int count)
     scrollToLineInDocument(cursorLineInDocument() - cursorLineOnScreen() - count);
 }
 
+// Emacs' recenter-top-bottom: successive C-l put the cursor line in the
+// middle, at the top and at the bottom of the window.
+void EmacsKeysHandler::Private::recenterTopBottom(int cycle)
+{
+    const int line = cursorLineInDocument();
+    const int lines = linesOnScreen();
+    if (cycle == 0)
+        scrollToLineInDocument(line - lines / 2);
+    else if (cycle == 1)
+        scrollToLineInDocument(line);
+    else
+        scrollToLineInDocument(line - lines + 1);
+    m_recenterCycle = (cycle + 1) % 3;
+}
+
 int EmacsKeysHandler::Private::lastPositionInDocument() const
 {
     QTextBlock block = m_tc.document()->lastBlock();
@@ -2622,34 +4708,75 @@ QWidget *EmacsKeysHandler::Private::editor() const
         : static_cast<QWidget *>(m_plaintextedit);
 }
 
+// Undo and redo move in the undo tree, so nothing undone is ever lost.
+// Point goes back to where it was before the change.
 void EmacsKeysHandler::Private::undo()
 {
-    int current = m_tc.document()->revision();
-    //endEditBlock();
-    EDITOR(undo());
-    //beginEditBlock();
-    int rev = m_tc.document()->revision();
-    if (current == rev)
+    const int pos = m_undoTree->undo();
+    if (pos == -1) {
         showBlackMessage(tr("Already at oldest change"));
-    else
-        showBlackMessage(QString());
-    if (m_undoCursorPosition.contains(rev))
-        m_tc.setPosition(m_undoCursorPosition[rev]);
+        return;
+    }
+    showBlackMessage(QString());
+    setPosition(pos);
+    setTargetColumn();
 }
 
 void EmacsKeysHandler::Private::redo()
 {
-    int current = m_tc.document()->revision();
-    //endEditBlock();
-    EDITOR(redo());
-    //beginEditBlock();
-    int rev = m_tc.document()->revision();
-    if (rev == current)
+    const int pos = m_undoTree->redo();
+    if (pos == -1) {
         showBlackMessage(tr("Already at newest change"));
-    else
+        return;
+    }
+    showBlackMessage(QString());
+    setPosition(pos);
+    setTargetColumn();
+}
+
+// C-x u shows where point is in the undo tree. p and n undo and redo,
+// b and f choose the branch n follows.
+void EmacsKeysHandler::Private::undoTreeVisualize()
+{
+    enterExMode();
+    m_mode = UndoTreeMode;
+    m_currentMessage.clear();
+    m_commandBuffer.clear();
+    updateMiniBuffer();
+}
+
+QString EmacsKeysHandler::Private::undoTreeMessage() const
+{
+    const int depth = m_undoTree->depth();
+    QString msg = tr("Undo tree: change %1 of %2")
+        .arg(depth).arg(depth + m_undoTree->redoDepth());
+    if (m_undoTree->branchCount() > 1)
+        msg += tr(", branch %1 of %2")
+            .arg(m_undoTree->branch() + 1).arg(m_undoTree->branchCount());
+    msg += tr(" (p, n, b, f or q) ");
+    return msg;
+}
+
+void EmacsKeysHandler::Private::handleUndoTreeKey(int key, const QString &text)
+{
+    const QChar c = text.isEmpty() ? QChar() : text.at(0);
+    if (c == 'p' || key == control('p') || key == Key_Up) {
+        undo();
+    } else if (c == 'n' || key == control('n') || key == Key_Down) {
+        redo();
+    } else if (c == 'b' || key == control('b') || key == Key_Left) {
+        if (!m_undoTree->selectBranch(-1))
+            QApplication::beep();
+    } else if (c == 'f' || key == control('f') || key == Key_Right) {
+        if (!m_undoTree->selectBranch(1))
+            QApplication::beep();
+    } else {
+        enterCommandMode();
         showBlackMessage(QString());
-    if (m_undoCursorPosition.contains(rev))
-        m_tc.setPosition(m_undoCursorPosition[rev]);
+        return;
+    }
+    m_currentMessage.clear();
+    updateMiniBuffer();
 }
 
 QString EmacsKeysHandler::Private::removeSelectedText()
@@ -2676,6 +4803,7 @@ void EmacsKeysHandler::Private::enterInsertMode()
 
 void EmacsKeysHandler::Private::enterCommandMode()
 {
+    m_completionTimer.stop();
     EDITOR(setCursorWidth(m_cursorWidth));
     EDITOR(setOverwriteMode(true));
     m_mode = CommandMode;
@@ -2697,14 +4825,37 @@ void EmacsKeysHandler::Private::recordJump()
 
 void EmacsKeysHandler::Private::recordNewUndo()
 {
-    //endEditBlock();
     UNDO_DEBUG("---- BREAK ----");
-    //beginEditBlock();
+    m_undoTree->boundary(position());
+    m_amalgamation = NoAmalgamation;
+}
+
+// Keys that only read input, like the characters typed in the
+// minibuffer or after C-u, do not amalgamate.
+UndoAmalgamation EmacsKeysHandler::Private::undoAmalgamation(
+    const QKeyEvent *ev) const
+{
+    if (m_jumpState != NoJump || m_charCommand != NoCharCommand
+            || isMiniBufferMode() || !m_prefixKeys.isEmpty()
+            || m_argumentState != NoArgument || !m_mvcount.isEmpty())
+        return NoAmalgamation;
+    const int key = ev->key();
+    const int mods = ev->modifiers() & ~Qt::KeypadModifier;
+    if (key == Key_Backspace && mods == Qt::NoModifier)
+        return AmalgamateBackspace;
+    if ((key == Key_Delete && mods == Qt::NoModifier)
+            || (key == Key_D && mods == Qt::ControlModifier))
+        return AmalgamateDelete;
+    const QString text = ev->text();
+    if (!text.isEmpty() && text.at(0).isPrint()
+            && (mods & (Qt::ControlModifier | Qt::AltModifier)) == 0)
+        return AmalgamateInsert;
+    return NoAmalgamation;
 }
 
 void EmacsKeysHandler::Private::insertAutomaticIndentation(bool goingDown)
 {
-    if (!hasConfig(ConfigAutoIndent))
+    if (!config().autoIndent)
         return;
     QTextBlock block = goingDown ? m_tc.block().previous() : m_tc.block().next();
     QString text = block.text();
@@ -2719,7 +4870,7 @@ void EmacsKeysHandler::Private::insertAutomaticIndentation(bool goingDown)
 
 bool EmacsKeysHandler::Private::removeAutomaticIndentation()
 {
-    if (!hasConfig(ConfigAutoIndent) || m_justAutoIndented == 0)
+    if (!config().autoIndent || m_justAutoIndented == 0)
         return false;
     m_tc.movePosition(StartOfLine, KeepAnchor);
     m_tc.removeSelectedText();
@@ -2730,7 +4881,7 @@ bool EmacsKeysHandler::Private::removeAutomaticIndentation()
 
 void EmacsKeysHandler::Private::handleStartOfLine()
 {
-    if (hasConfig(ConfigStartOfLine))
+    if (config().startOfLine)
         moveToFirstNonBlankOnLine();
 }
 
@@ -2738,12 +4889,15 @@ void EmacsKeysHandler::Private::replay(const QString &command, int n)
 {
     //qDebug() << "REPLAY: " << command;
     m_inReplay = true;
+    // the characters inserted one by one are a single undo step
+    beginEditBlock();
     for (int i = n; --i >= 0; ) {
         foreach (QChar c, command) {
             //qDebug() << "  REPLAY: " << QString(c);
             handleKey(c.unicode(), c.unicode(), QString(c));
         }
     }
+    endEditBlock();
     m_inReplay = false;
 }
 
@@ -2764,7 +4918,21 @@ EmacsKeysHandler::~EmacsKeysHandler()
 
 bool EmacsKeysHandler::eventFilter(QObject *ob, QEvent *ev)
 {
-    bool active = theEmacsKeysSetting(ConfigUseEmacsKeys)->value().toBool();
+    const bool active = theEmacsKeysConfig().useEmacsKeys;
+
+    const bool onViewport = ob == d->viewport();
+    if ((ob == d->editor() || onViewport) && (ev->type() == QEvent::Resize
+            || ev->type() == QEvent::FontChange))
+        d->invalidateScreenGeometry();
+
+    // mouse and focus changes must see the collapsed key repeat cursor
+    if (d->m_cursorCommitTimer.isActive() && (ev->type() == QEvent::FocusOut
+            || ev->type() == QEvent::MouseButtonPress
+            || ev->type() == QEvent::MouseButtonDblClick))
+        d->commitCursor();
+
+    if (onViewport)
+        return QObject::eventFilter(ob, ev);
 
     if (active && ev->type() == QEvent::KeyPress && ob == d->editor()) {
         QKeyEvent *kev = static_cast<QKeyEvent *>(ev);
@@ -2796,6 +4964,27 @@ void EmacsKeysHandler::installEventFilter()
     d->installEventFilter();
 }
 
+void EmacsKeysHandler::commitCursor()
+{
+    d->commitCursor();
+}
+
+void EmacsKeysHandler::updateStatus()
+{
+    d->updateStatus();
+}
+
+void EmacsKeysHandler::fileLoaded(const QString &fileName, int lines,
+    qint64 characters)
+{
+    d->fileLoaded(fileName, lines, characters);
+}
+
+void EmacsKeysHandler::undoHistoryDiscarded()
+{
+    d->showBlackMessage(tr("Undo history discarded"));
+}
+
 void EmacsKeysHandler::setupWidget()
 {
     d->setupWidget();
@@ -2811,6 +5000,11 @@ void EmacsKeysHandler::handleCommand(const QString &cmd)
     d->handleCommand(cmd);
 }
 
+void EmacsKeysHandler::runCommand(const QString &name)
+{
+    d->runCommand(name);
+}
+
 void EmacsKeysHandler::setCurrentFileName(const QString &fileName)
 {
    d->m_currentFileName = fileName;
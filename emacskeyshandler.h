@@ -42,6 +42,9 @@ public slots:
     // information from widget;
     void handleCommand(const QString &cmd);
 
+    // Runs an Emacs command like "indent-rigidly" by name.
+    void runCommand(const QString &name);
+
     void installEventFilter();
 
     // Convenience
@@ -55,8 +58,10 @@ signals:
     void quitRequested(bool force);
     void quitAllRequested(bool force);
     void selectionChanged(const QList<QTextEdit::ExtraSelection> &selection);
-    void writeFileRequested(bool *handled,
-        const QString &fileName, const QString &contents);
+    void writeFileRequested(bool *handled, const QString &fileName);
+    void substituteInBuffersRequested(const QString &needle,
+        const QString &replacement, const QString &flags);
+    void openDocumentsRequested(QList<QTextDocument *> *documents);
     void moveToMatchingParenthesis(bool *moved, bool *forward, QTextCursor *cursor);
     void indentRegion(int *amount, int beginLine, int endLine, QChar typedChar);
     void completionRequested();
@@ -67,6 +72,12 @@ signals:
 public:
     class Private;
 
+private slots:
+    void commitCursor();
+    void updateStatus();
+    void fileLoaded(const QString &fileName, int lines, qint64 characters);
+    void undoHistoryDiscarded();
+
 private:
     bool eventFilter(QObject *ob, QEvent *ev);
     friend class Private;
@@ -16,7 +16,10 @@
 
 #include "emacskeysplugin.h"
 
+#include "buffersubstitute.h"
 #include "emacskeyshandler.h"
+#include "minibuffer.h"
+#include "registers.h"
 #include "ui_emacskeysoptions.h"
 
 
@@ -51,14 +54,18 @@
 #include <indenter.h>
 
 #include <QtCore/QDebug>
+#include <QtCore/QEvent>
 #include <QtCore/QtPlugin>
 #include <QtCore/QObject>
 #include <QtCore/QPoint>
 #include <QtCore/QSettings>
 #include <QtCore/QHash>
 
+#include <QtGui/QAction>
+#include <QtGui/QApplication>
 #include <QtGui/QMessageBox>
 #include <QtGui/QPlainTextEdit>
+#include <QtGui/QStatusBar>
 #include <QtGui/QTextBlock>
 #include <QtGui/QTextCursor>
 #include <QtGui/QTextEdit>
@@ -77,6 +84,32 @@ namespace Constants {
 const char * const INSTALL_HANDLER        = "TextEditor.EmacsKeysHandler";
 const char * const MINI_BUFFER            = "TextEditor.EmacsKeysMiniBuffer";
 
+// Commands on C-x keys, run by name in the handler of the current editor.
+struct CommandAction
+{
+    const char *id;
+    const char *keys;
+    const char *name;
+};
+
+const CommandAction COMMAND_ACTIONS[] = {
+    { "EmacsKeys.StartKbdMacro", "Ctrl+X, (", "start-kbd-macro" },
+    { "EmacsKeys.EndKbdMacro", "Ctrl+X, )", "end-kbd-macro" },
+    { "EmacsKeys.CallLastKbdMacro", "Ctrl+X, E", "call-last-kbd-macro" },
+    { "EmacsKeys.ApplyMacroToRegionLines", "Ctrl+X, Ctrl+K, R", "apply-macro-to-region-lines" },
+    { "EmacsKeys.IndentRigidly", "Ctrl+X, Tab", "indent-rigidly" },
+    { "EmacsKeys.CopyToRegister", "Ctrl+X, R, S", "copy-to-register" },
+    { "EmacsKeys.InsertRegister", "Ctrl+X, R, I", "insert-register" },
+    { "EmacsKeys.PointToRegister", "Ctrl+X, R, Space", "point-to-register" },
+    { "EmacsKeys.JumpToRegister", "Ctrl+X, R, J", "jump-to-register" },
+    { "EmacsKeys.NumberToRegister", "Ctrl+X, R, N", "number-to-register" },
+    { "EmacsKeys.IncrementRegister", "Ctrl+X, R, +", "increment-register" },
+    { "EmacsKeys.KillRectangle", "Ctrl+X, R, K", "kill-rectangle" },
+    { "EmacsKeys.YankRectangle", "Ctrl+X, R, Y", "yank-rectangle" },
+    { "EmacsKeys.StringRectangle", "Ctrl+X, R, T", "string-rectangle" },
+    { "EmacsKeys.UndoTreeVisualize", "Ctrl+X, U", "undo-tree-visualize" },
+};
+
 } // namespace Constants
 } // namespace EmacsKeys
 
@@ -225,26 +258,39 @@ private slots:
     void editorAboutToClose(Core::IEditor *);
 
     void setUseEmacsKeys(const QVariant &value);
-    void quitEmacsKeys();
     void triggerCompletions();
     void windowCommand(int key);
     void find(bool reverse);
     void findNext(bool reverse);
     void showSettingsDialog();
+    void runCommand();
 
     void showCommandBuffer(const QString &contents);
     void showExtraInformation(const QString &msg);
     void changeSelection(const QList<QTextEdit::ExtraSelection> &selections);
-    void writeFile(bool *handled, const QString &fileName, const QString &contents);
+    void writeFile(bool *handled, const QString &fileName);
+    void substituteInBuffers(const QString &needle, const QString &replacement,
+        const QString &flags);
+    void substituteInBuffersFinished(int substitutions, int changedDocuments,
+        int skippedDocuments);
+    void openDocuments(QList<QTextDocument *> *documents);
     void quitFile(bool forced);
     void quitAllFiles(bool forced);
     void moveToMatchingParenthesis(bool *moved, bool *forward, QTextCursor *cursor);
     void indentRegion(int *amount, int beginLine, int endLine,  QChar typedChar);
 
 private:
+    bool eventFilter(QObject *ob, QEvent *ev);
+    void createHandler(QWidget *widget);
+
     EmacsKeysPlugin *q;
     EmacsKeysOptionPage *m_emacsKeysOptionsPage;
+    MiniBuffer *m_miniBuffer;
+    // both directions, so that neither lookup has to scan all editors
     QHash<Core::IEditor *, EmacsKeysHandler *> m_editorToHandler;
+    QHash<EmacsKeysHandler *, Core::IEditor *> m_handlerToEditor;
+    // editors that never had the focus yet and have no handler
+    QHash<QWidget *, Core::IEditor *> m_pendingEditors;
 
     void triggerAction(const QString& code);
 };
@@ -256,17 +302,29 @@ EmacsKeysPluginPrivate::EmacsKeysPluginPrivate(EmacsKeysPlugin *plugin)
 {       
     q = plugin;
     m_emacsKeysOptionsPage = 0;
+    m_miniBuffer = 0;
 }
 
 EmacsKeysPluginPrivate::~EmacsKeysPluginPrivate()
 {
 }
 
+// The registers are kept next to Qt Creator's own settings.
+static QString registersFileName()
+{
+    return Core::ICore::instance()->userResourcePath()
+        + QLatin1String("/emacskeys-registers.dat");
+}
+
 void EmacsKeysPluginPrivate::shutdown()
 {
     q->removeObject(m_emacsKeysOptionsPage);
     delete m_emacsKeysOptionsPage;
     m_emacsKeysOptionsPage = 0;
+    delete m_miniBuffer;
+    m_miniBuffer = 0;
+    if (theEmacsKeysConfig().persistRegisters)
+        Registers::instance()->save(registersFileName());
     theEmacsKeysSettings()->writeSettings(Core::ICore::instance()->settings());
     delete theEmacsKeysSettings();
 }
@@ -281,6 +339,8 @@ bool EmacsKeysPluginPrivate::initialize()
     m_emacsKeysOptionsPage = new EmacsKeysOptionPage;
     q->addObject(m_emacsKeysOptionsPage);
     theEmacsKeysSettings()->readSettings(Core::ICore::instance()->settings());
+    if (theEmacsKeysConfig().persistRegisters)
+        Registers::instance()->load(registersFileName());
     
     QList<int> globalcontext;
     globalcontext << Core::Constants::C_GLOBAL_ID;
@@ -292,6 +352,18 @@ bool EmacsKeysPluginPrivate::initialize()
         actionManager->actionContainer(Core::Constants::M_EDIT_ADVANCED);
     advancedMenu->addAction(cmd, Core::Constants::G_EDIT_EDITOR);
 
+    const int commandCount = sizeof(Constants::COMMAND_ACTIONS)
+        / sizeof(Constants::COMMAND_ACTIONS[0]);
+    for (int i = 0; i != commandCount; ++i) {
+        const Constants::CommandAction &command = Constants::COMMAND_ACTIONS[i];
+        QAction *action = new QAction(QLatin1String(command.name), this);
+        action->setData(QLatin1String(command.name));
+        connect(action, SIGNAL(triggered()), this, SLOT(runCommand()));
+        cmd = actionManager->registerAction(action, QLatin1String(command.id),
+            globalcontext);
+        cmd->setDefaultKeySequence(QKeySequence(QLatin1String(command.keys)));
+    }
+
     ActionContainer* actionContainer = actionManager->actionContainer(Core::Constants::M_FILE);
     QMenu* menu = actionContainer->menu();
     menu->setTitle("F&ile");
@@ -321,11 +393,16 @@ bool EmacsKeysPluginPrivate::initialize()
     command->setKeySequence(QKeySequence("Ctrl+X,B"));
 
     command = actionManager->command(TextEditor::Constants::COMPLETE_THIS);
-    command->setKeySequence(QKeySequence("Alt+/"));
+    command->setKeySequence(QKeySequence("Ctrl+Alt+I"));
 
     command = actionManager->command("QtCreator.Sidebar.File System");
     command->setKeySequence(QKeySequence("Ctrl+X,Ctrl+B"));
 
+    m_miniBuffer = new MiniBuffer;
+    m_miniBuffer->setObjectName(QLatin1String(Constants::MINI_BUFFER));
+    Core::ICore::instance()->statusBar()->addWidget(m_miniBuffer, 1);
+    m_miniBuffer->setVisible(theEmacsKeysConfig().useEmacsKeys);
+
     // EditorManager
     QObject *editorManager = Core::ICore::instance()->editorManager();
     connect(editorManager, SIGNAL(editorAboutToClose(Core::IEditor*)),
@@ -346,6 +423,17 @@ void EmacsKeysPluginPrivate::showSettingsDialog()
     Core::ICore::instance()->showOptionsDialog("EmacsKeys", "General");
 }
 
+void EmacsKeysPluginPrivate::runCommand()
+{
+    QAction *action = qobject_cast<QAction *>(sender());
+    QTC_ASSERT(action, return);
+    if (!theEmacsKeysConfig().useEmacsKeys)
+        return;
+    Core::IEditor *editor = Core::EditorManager::instance()->currentEditor();
+    if (EmacsKeysHandler *handler = m_editorToHandler.value(editor))
+        handler->runCommand(action->data().toString());
+}
+
 void EmacsKeysPluginPrivate::triggerAction(const QString& code)
 {
     Core::ActionManager *am = Core::ICore::instance()->actionManager();
@@ -421,19 +509,49 @@ void EmacsKeysPluginPrivate::editorOpened(Core::IEditor *editor)
     //qDebug() << "OPENING: " << editor << editor->widget()
     //    << "MODE: " << theEmacsKeysSetting(ConfigUseEmacsKeys)->value();
 
+    // Restoring a session opens many editors that are never looked at, so
+    // the handler is only created once the editor gets the focus.
+    m_pendingEditors[widget] = editor;
+    if (widget->hasFocus() && theEmacsKeysConfig().useEmacsKeys)
+        createHandler(widget);
+    else
+        widget->installEventFilter(this);
+}
+
+bool EmacsKeysPluginPrivate::eventFilter(QObject *ob, QEvent *ev)
+{
+    // keys only arrive after the focus, so this comes first
+    if (ev->type() == QEvent::FocusIn && theEmacsKeysConfig().useEmacsKeys
+            && m_pendingEditors.contains(static_cast<QWidget *>(ob)))
+        createHandler(static_cast<QWidget *>(ob));
+    return QObject::eventFilter(ob, ev);
+}
+
+void EmacsKeysPluginPrivate::createHandler(QWidget *widget)
+{
+    Core::IEditor *editor = m_pendingEditors.take(widget);
+    widget->removeEventFilter(this);
+
     EmacsKeysHandler *handler = new EmacsKeysHandler(widget, widget);
     m_editorToHandler[editor] = handler;
+    m_handlerToEditor[handler] = editor;
 
     connect(handler, SIGNAL(extraInformationChanged(QString)),
         this, SLOT(showExtraInformation(QString)));
     connect(handler, SIGNAL(commandBufferChanged(QString)),
         this, SLOT(showCommandBuffer(QString)));
+    connect(handler, SIGNAL(statusDataChanged(QString)),
+        m_miniBuffer, SLOT(setStatus(QString)));
     connect(handler, SIGNAL(quitRequested(bool)),
         this, SLOT(quitFile(bool)), Qt::QueuedConnection);
     connect(handler, SIGNAL(quitAllRequested(bool)),
         this, SLOT(quitAllFiles(bool)), Qt::QueuedConnection);
-    connect(handler, SIGNAL(writeFileRequested(bool*,QString,QString)),
-        this, SLOT(writeFile(bool*,QString,QString)));
+    connect(handler, SIGNAL(writeFileRequested(bool*,QString)),
+        this, SLOT(writeFile(bool*,QString)));
+    connect(handler, SIGNAL(substituteInBuffersRequested(QString,QString,QString)),
+        this, SLOT(substituteInBuffers(QString,QString,QString)));
+    connect(handler, SIGNAL(openDocumentsRequested(QList<QTextDocument*>*)),
+        this, SLOT(openDocuments(QList<QTextDocument*>*)));
     connect(handler, SIGNAL(selectionChanged(QList<QTextEdit::ExtraSelection>)),
         this, SLOT(changeSelection(QList<QTextEdit::ExtraSelection>)));
     connect(handler, SIGNAL(moveToMatchingParenthesis(bool*,bool*,QTextCursor*)),
@@ -453,14 +571,21 @@ void EmacsKeysPluginPrivate::editorOpened(Core::IEditor *editor)
     handler->installEventFilter();
     
     // pop up the bar
-    if (theEmacsKeysSetting(ConfigUseEmacsKeys)->value().toBool())
+    if (theEmacsKeysConfig().useEmacsKeys)
        showCommandBuffer("");
 }
 
 void EmacsKeysPluginPrivate::editorAboutToClose(Core::IEditor *editor)
 {
     //qDebug() << "CLOSING: " << editor << editor->widget();
-    m_editorToHandler.remove(editor);
+    QWidget *widget = editor->widget();
+    if (m_pendingEditors.remove(widget))
+        widget->removeEventFilter(this);
+    // the close may have been triggered from within the handler
+    if (EmacsKeysHandler *handler = m_editorToHandler.take(editor)) {
+        m_handlerToEditor.remove(handler);
+        handler->deleteLater();
+    }
 }
 
 void EmacsKeysPluginPrivate::setUseEmacsKeys(const QVariant &value)
@@ -468,17 +593,16 @@ void EmacsKeysPluginPrivate::setUseEmacsKeys(const QVariant &value)
     //qDebug() << "SET USE EMACSKEYS" << value;
     bool on = value.toBool();
     if (on) {
-        Core::EditorManager::instance()->showEditorStatusBar( 
-            QLatin1String(Constants::MINI_BUFFER), 
-            "vi emulation mode. Type :q to leave. Use , Ctrl-R to trigger run.",
-            tr("Quit EmacsKeys"), this, SLOT(quitEmacsKeys()));
-        foreach (Core::IEditor *editor, m_editorToHandler.keys())
-            m_editorToHandler[editor]->setupWidget();
+        m_miniBuffer->show();
+        foreach (EmacsKeysHandler *handler, m_editorToHandler)
+            handler->setupWidget();
+        QWidget *focusWidget = QApplication::focusWidget();
+        if (m_pendingEditors.contains(focusWidget))
+            createHandler(focusWidget);
     } else {
-        Core::EditorManager::instance()->hideEditorStatusBar(
-            QLatin1String(Constants::MINI_BUFFER));
-        foreach (Core::IEditor *editor, m_editorToHandler.keys())
-            m_editorToHandler[editor]->restoreWidget();
+        m_miniBuffer->hide();
+        foreach (EmacsKeysHandler *handler, m_editorToHandler)
+            handler->restoreWidget();
     }
 }
 
@@ -499,7 +623,7 @@ void EmacsKeysPluginPrivate::quitFile(bool forced)
     if (!handler)
         return;
     QList<Core::IEditor *> editors;
-    editors.append(m_editorToHandler.key(handler));
+    editors.append(m_handlerToEditor.value(handler));
     Core::EditorManager::instance()->closeEditors(editors, !forced);
 }
 
@@ -508,16 +632,13 @@ void EmacsKeysPluginPrivate::quitAllFiles(bool forced)
     Core::EditorManager::instance()->closeAllEditors(!forced);
 }
 
-void EmacsKeysPluginPrivate::writeFile(bool *handled,
-    const QString &fileName, const QString &contents)
+void EmacsKeysPluginPrivate::writeFile(bool *handled, const QString &fileName)
 {
-    Q_UNUSED(contents);
-
     EmacsKeysHandler *handler = qobject_cast<EmacsKeysHandler *>(sender());
     if (!handler)
         return;
 
-    Core::IEditor *editor = m_editorToHandler.key(handler);
+    Core::IEditor *editor = m_handlerToEditor.value(handler);
     if (editor && editor->file()->fileName() == fileName) {
         // Handle that as a special case for nicer interaction with core
         Core::IFile *file = editor->file();
@@ -528,6 +649,43 @@ void EmacsKeysPluginPrivate::writeFile(bool *handled,
     } 
 }
 
+// The documents of all text editors, including those that never had the
+// focus and have no handler yet.
+void EmacsKeysPluginPrivate::openDocuments(QList<QTextDocument *> *documents)
+{
+    QList<QWidget *> widgets = m_pendingEditors.keys();
+    foreach (EmacsKeysHandler *handler, m_editorToHandler)
+        widgets.append(handler->widget());
+    foreach (QWidget *widget, widgets) {
+        if (QPlainTextEdit *ed = qobject_cast<QPlainTextEdit *>(widget))
+            documents->append(ed->document());
+        else if (QTextEdit *ed = qobject_cast<QTextEdit *>(widget))
+            documents->append(ed->document());
+    }
+}
+
+void EmacsKeysPluginPrivate::substituteInBuffers(const QString &needle,
+    const QString &replacement, const QString &flags)
+{
+    QList<QTextDocument *> documents;
+    openDocuments(&documents);
+    BufferSubstitute *substitute = new BufferSubstitute(documents, this);
+    connect(substitute, SIGNAL(finished(int,int,int)),
+        this, SLOT(substituteInBuffersFinished(int,int,int)));
+    substitute->start(needle, replacement, flags);
+}
+
+void EmacsKeysPluginPrivate::substituteInBuffersFinished(int substitutions,
+    int changedDocuments, int skippedDocuments)
+{
+    QString msg = tr("%1 substitutions in %2 buffers")
+        .arg(substitutions).arg(changedDocuments);
+    if (skippedDocuments)
+        msg += tr(", %1 buffers were changed meanwhile and skipped")
+            .arg(skippedDocuments);
+    showCommandBuffer(msg);
+}
+
 void EmacsKeysPluginPrivate::moveToMatchingParenthesis(bool *moved, bool *forward,
         QTextCursor *cursor)
 {
@@ -582,42 +740,46 @@ void EmacsKeysPluginPrivate::indentRegion(int *amount, int beginLine, int endLin
     indenter.setIndentSize(tabSettings.m_indentSize);
     indenter.setTabSize(tabSettings.m_tabSize);
 
-    const QTextDocument *doc = bt->document();
+    QTextDocument *doc = bt->document();
     QTextBlock begin = doc->findBlockByNumber(beginLine);
     QTextBlock end = doc->findBlockByNumber(endLine);
     const TextEditor::TextBlockIterator docStart(doc->begin());
+
+    // All lines change in one edit block, so the region is one undo step
+    // and the document is laid out once at the end instead of per line.
+    // Lines that already have the right indentation string are not
+    // touched, a line indented with spaces where tabs belong still is.
+    QTextCursor cursor(doc);
+    cursor.beginEditBlock();
     QTextBlock cur = begin;
     do {
-        if (typedChar == 0 && cur.text().simplified().isEmpty()) {
+        const QString text = cur.text();
+        if (typedChar == 0 && text.simplified().isEmpty()) {
             *amount = 0;
-            if (cur != end) {
-                QTextCursor cursor(cur);
-                while (!cursor.atBlockEnd())
-                    cursor.deleteChar();
+            if (cur != end && !text.isEmpty()) {
+                cursor.setPosition(cur.position());
+                cursor.setPosition(cur.position() + text.size(),
+                    QTextCursor::KeepAnchor);
+                cursor.removeSelectedText();
             }
         } else {
             const TextEditor::TextBlockIterator current(cur);
             const TextEditor::TextBlockIterator next(cur.next());
             *amount = indenter.indentForBottomLine(current, docStart, next, typedChar);
-            if (cur != end)
+            if (cur != end && text.left(tabSettings.firstNonSpace(text))
+                    != tabSettings.indentationString(0, *amount))
                 tabSettings.indentLine(cur, *amount);
         }
         if (cur != end)
            cur = cur.next();
     } while (cur != end);
-}
-
-void EmacsKeysPluginPrivate::quitEmacsKeys()
-{
-    theEmacsKeysSetting(ConfigUseEmacsKeys)->setValue(false);
+    cursor.endEditBlock();
 }
 
 void EmacsKeysPluginPrivate::showCommandBuffer(const QString &contents)
 {
     //qDebug() << "SHOW COMMAND BUFFER" << contents;
-    Core::EditorManager::instance()->showEditorStatusBar( 
-        QLatin1String(Constants::MINI_BUFFER), contents,
-        tr("Quit EmacsKeys"), this, SLOT(quitEmacsKeys()));
+    m_miniBuffer->setContents(contents);
 }
 
 void EmacsKeysPluginPrivate::showExtraInformation(const QString &text)
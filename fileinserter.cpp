@@ -0,0 +1,191 @@
+#include "fileinserter.h"
+
+#include <QHash>
+#include <QTextCodec>
+#include <QTextDocument>
+#include <QTimer>
+#include <QWidget>
+
+// big enough to keep the number of steps low, small enough to decode and
+// lay out well within a frame
+static const int ChunkSize = 256 * 1024;
+
+namespace {
+
+struct DocumentLoads
+{
+  DocumentLoads() : loads(0), replacing(0) {}
+  int loads;
+  int replacing; // loads that turned the undo stack off
+};
+
+struct EditorLoads
+{
+  EditorLoads() : loads(0), readOnly(false) {}
+  int loads;
+  bool readOnly; // before the first load
+};
+
+}
+
+typedef QHash<QTextDocument*, DocumentLoads> DocumentLoadsHash;
+Q_GLOBAL_STATIC(DocumentLoadsHash, documentLoads)
+typedef QHash<QWidget*, EditorLoads> EditorLoadsHash;
+Q_GLOBAL_STATIC(EditorLoadsHash, editorLoads)
+
+FileInserter::FileInserter(QTextDocument* document, QWidget* editor,
+                           QObject* parent)
+  : QObject(parent), document(document), editor(editor),
+    documentKey(document), editorKey(editor), acquired(false), revision(0),
+    data(0), size(0), offset(0), decoder(0), replace(false), first(true),
+    lines(0), characters(0)
+{
+}
+
+FileInserter::~FileInserter()
+{
+  release();
+  if (data) {
+    file.unmap(data);
+  }
+  delete decoder;
+}
+
+bool FileInserter::isLoading(QTextDocument* document)
+{
+  return documentLoads()->contains(document);
+}
+
+void FileInserter::acquire()
+{
+  acquired = true;
+  DocumentLoads& loads = (*documentLoads())[documentKey];
+  ++loads.loads;
+  if (replace) {
+    ++loads.replacing;
+    document->setUndoRedoEnabled(false);
+  }
+  if (editor) {
+    EditorLoads& state = (*editorLoads())[editorKey];
+    if (state.loads++ == 0) {
+      state.readOnly = editor->property("readOnly").toBool();
+    }
+    // keep typing from interleaving with the chunks coming in
+    editor->setProperty("readOnly", true);
+  }
+}
+
+void FileInserter::release()
+{
+  if (!acquired) {
+    return;
+  }
+  acquired = false;
+  DocumentLoadsHash* documents = documentLoads();
+  if (documents && documents->contains(documentKey)) {
+    DocumentLoads& loads = (*documents)[documentKey];
+    if (replace && --loads.replacing == 0 && document) {
+      document->setUndoRedoEnabled(true);
+    }
+    if (--loads.loads == 0) {
+      documents->remove(documentKey);
+    }
+  }
+  EditorLoadsHash* editors = editorLoads();
+  if (editorKey && editors && editors->contains(editorKey)) {
+    EditorLoads& state = (*editors)[editorKey];
+    if (--state.loads == 0) {
+      if (editor) {
+        editor->setProperty("readOnly", state.readOnly);
+      }
+      editors->remove(editorKey);
+    }
+  }
+}
+
+bool FileInserter::start(const QString& fileName, int position, bool replace)
+{
+  file.setFileName(fileName);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  size = file.size();
+  // pipes and other special files cannot be mapped, they are read instead
+  data = size > 0 ? file.map(0, size) : 0;
+  decoder = QTextCodec::codecForLocale()->makeDecoder();
+
+  this->replace = replace;
+  acquire();
+  cursor = QTextCursor(document);
+  if (replace) {
+    cursor.select(QTextCursor::Document);
+    cursor.removeSelectedText();
+  } else {
+    cursor.setPosition(position);
+  }
+  QTimer::singleShot(0, this, SLOT(insertChunk()));
+  return true;
+}
+
+QString FileInserter::errorString() const
+{
+  return file.errorString();
+}
+
+void FileInserter::insertChunk()
+{
+  if (!document) {
+    deleteLater();
+    return;
+  }
+
+  QByteArray bytes;
+  const char* chunk;
+  int length;
+  if (data) {
+    length = int(qMin<qint64>(ChunkSize, size - offset));
+    chunk = reinterpret_cast<const char*>(data) + offset;
+  } else {
+    bytes = file.read(ChunkSize);
+    length = bytes.size();
+    chunk = bytes.constData();
+  }
+  offset += length;
+
+  // the decoder keeps multi byte sequences that are split between chunks
+  const QString text = decoder->toUnicode(chunk, length);
+  lines += text.count(QLatin1Char('\n'));
+  characters += text.size();
+
+  // joining an edit made in between would make it part of the load
+  if (first || document->revision() != revision) {
+    cursor.beginEditBlock();
+  } else {
+    cursor.joinPreviousEditBlock();
+  }
+  cursor.insertText(text);
+  cursor.endEditBlock();
+  revision = document->revision();
+  first = false;
+
+  if (length == 0 || (data && offset >= size)) {
+    finish();
+  } else {
+    QTimer::singleShot(0, this, SLOT(insertChunk()));
+  }
+}
+
+void FileInserter::finish()
+{
+  if (data) {
+    file.unmap(data);
+    data = 0;
+  }
+  file.close();
+  release();
+  if (replace) {
+    document->setModified(false);
+  }
+  emit finished(file.fileName(), lines, characters);
+  deleteLater();
+}
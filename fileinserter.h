@@ -0,0 +1,66 @@
+#ifndef FILEINSERTER_H
+#define FILEINSERTER_H
+
+#include <QFile>
+#include <QObject>
+#include <QPointer>
+#include <QTextCursor>
+
+class QTextDecoder;
+class QTextDocument;
+class QWidget;
+
+// Loads a file into a QTextDocument without blocking the event loop.
+// The file is memory mapped if possible and decoded and inserted one
+// chunk per event loop iteration, so that even very large files keep
+// the UI responsive while they come in. All chunks form one undo step,
+// unless something else changed the document in between.
+//
+// While it runs the editor is read only. That and the undo stack turned
+// off for replacing are restored when the last load into the editor or
+// the document ends, also when the inserter is destroyed early.
+class FileInserter : public QObject
+{
+  Q_OBJECT
+
+public:
+  FileInserter(QTextDocument* document, QWidget* editor, QObject* parent = 0);
+  ~FileInserter();
+  // Inserts the file at position, or replaces the whole document without
+  // recording undo information if replace is set.
+  bool start(const QString& fileName, int position, bool replace);
+  QString errorString() const;
+  // Whether a file is still coming into document.
+  static bool isLoading(QTextDocument* document);
+
+signals:
+  void finished(const QString& fileName, int lines, qint64 characters);
+
+private slots:
+  void insertChunk();
+
+private:
+  void acquire();
+  void release();
+  void finish();
+
+  QPointer<QTextDocument> document;
+  QPointer<QWidget> editor;
+  // the keys of the hashes of loads in flight, also after deletion
+  QTextDocument* documentKey;
+  QWidget* editorKey;
+  bool acquired;
+  int revision;
+  QTextCursor cursor;
+  QFile file;
+  uchar* data;
+  qint64 size;
+  qint64 offset;
+  QTextDecoder* decoder;
+  bool replace;
+  bool first;
+  int lines;
+  qint64 characters;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#include "minibuffer.h"
+
+#include <QFontMetrics>
+#include <QHBoxLayout>
+#include <QLabel>
+
+MiniBuffer::MiniBuffer(QWidget* parent)
+  : QWidget(parent), contentsLabel(new QLabel(this)),
+    statusLabel(new QLabel(this))
+{
+  contentsLabel->setTextFormat(Qt::PlainText);
+  statusLabel->setTextFormat(Qt::PlainText);
+  // a fixed width keeps the contents from jumping as the position changes
+  statusLabel->setMinimumWidth(
+      statusLabel->fontMetrics().width(QLatin1String("00000,000   100%")));
+
+  QHBoxLayout* layout = new QHBoxLayout(this);
+  layout->setMargin(0);
+  layout->addWidget(contentsLabel, 1);
+  layout->addWidget(statusLabel);
+}
+
+void MiniBuffer::setContents(const QString& contents)
+{
+  if (contents == this->contents) {
+    return;
+  }
+  this->contents = contents;
+  contentsLabel->setText(contents);
+}
+
+void MiniBuffer::setStatus(const QString& status)
+{
+  if (status == this->status) {
+    return;
+  }
+  this->status = status;
+  statusLabel->setText(status);
+}
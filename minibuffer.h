@@ -0,0 +1,30 @@
+#ifndef MINIBUFFER_H
+#define MINIBUFFER_H
+
+#include <QString>
+#include <QWidget>
+
+class QLabel;
+
+// The line at the bottom of the main window that shows messages and the
+// input of minibuffer commands, with the cursor position on the right.
+// Text that is set again unchanged does not cause a relayout.
+class MiniBuffer : public QWidget
+{
+  Q_OBJECT
+
+public:
+  MiniBuffer(QWidget* parent = 0);
+
+public slots:
+  void setContents(const QString& contents);
+  void setStatus(const QString& status);
+
+private:
+  QLabel* contentsLabel;
+  QLabel* statusLabel;
+  QString contents;
+  QString status;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "registers.h"
+
+#include "documentwriter.h"
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QFile>
+
+// "EKRG", followed by the format version
+static const quint32 magic = 0x454b5247;
+static const quint32 version = 1;
+
+Registers::Registers()
+  : totalSize(0)
+{
+}
+
+Registers* Registers::instance()
+{
+  static Registers* instance;
+  if (!instance) {
+    instance = new Registers();
+  }
+  return instance;
+}
+
+Registers::Register Registers::get(QChar name) const
+{
+  return follow(registers.value(name.unicode()));
+}
+
+// Takes the position of a point register from its cursor, which moved
+// with the edits of the document. Once the document is gone the position
+// the register was set at is used again.
+Registers::Register Registers::follow(Register reg)
+{
+  if (reg.type == Register::Point && !reg.cursor.isNull()) {
+    reg.value = reg.cursor.position();
+  }
+  return reg;
+}
+
+bool Registers::setText(QChar name, const QString& text)
+{
+  const int oldSize = get(name).text.size();
+  if (totalSize - oldSize + text.size() > maxTotalSize) {
+    return false;
+  }
+  Register reg;
+  reg.type = Register::Text;
+  reg.text = text;
+  set(name, reg);
+  return true;
+}
+
+void Registers::setPoint(QChar name, const QString& fileName,
+                         const QTextCursor& position)
+{
+  Register reg;
+  reg.type = Register::Point;
+  reg.text = fileName;
+  reg.value = position.position();
+  reg.cursor = QTextCursor(position.document());
+  reg.cursor.setPosition(position.position());
+  set(name, reg);
+}
+
+void Registers::setNumber(QChar name, qint64 number)
+{
+  Register reg;
+  reg.type = Register::Number;
+  reg.value = number;
+  set(name, reg);
+}
+
+void Registers::set(QChar name, const Register& reg)
+{
+  Register& old = registers[name.unicode()];
+  // file names of point registers are not worth counting
+  if (old.type == Register::Text) {
+    totalSize -= old.text.size();
+  }
+  if (reg.type == Register::Text) {
+    totalSize += reg.text.size();
+  }
+  old = reg;
+}
+
+bool Registers::load(const QString& fileName)
+{
+  QFile file(fileName);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QDataStream in(&file);
+  quint32 fileMagic, fileVersion;
+  in >> fileMagic >> fileVersion;
+  if (fileMagic != magic || fileVersion != version) {
+    return false;
+  }
+  quint32 count;
+  in >> count;
+  for (quint32 i = 0; i != count && in.status() == QDataStream::Ok; ++i) {
+    quint16 name;
+    quint8 type;
+    Register reg;
+    in >> name >> type >> reg.text >> reg.value;
+    reg.type = Register::Type(type);
+    if (reg.type == Register::Text
+        && totalSize + reg.text.size() > maxTotalSize) {
+      continue;
+    }
+    set(QChar(name), reg);
+  }
+  return in.status() == QDataStream::Ok;
+}
+
+// Written like a document, so a crash while saving leaves the old file.
+bool Registers::save(const QString& fileName) const
+{
+  QByteArray data;
+  QBuffer buffer(&data);
+  buffer.open(QIODevice::WriteOnly);
+  QDataStream out(&buffer);
+  out << magic << version << quint32(registers.size());
+  QHash<ushort, Register>::ConstIterator it = registers.constBegin();
+  for (; it != registers.constEnd(); ++it) {
+    const Register reg = follow(it.value());
+    out << quint16(it.key()) << quint8(reg.type) << reg.text << reg.value;
+  }
+  return out.status() == QDataStream::Ok
+      && DocumentWriter(fileName).write(data);
+}
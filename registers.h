@@ -0,0 +1,49 @@
+#ifndef REGISTERS_H
+#define REGISTERS_H
+
+#include <QChar>
+#include <QHash>
+#include <QString>
+#include <QTextCursor>
+
+// The Emacs registers, shared by all editors. A register holds text, a
+// position in a file or a number. Text is kept as an implicitly shared
+// QString, so reading a register to insert it does not copy the text.
+// The text of all registers together is limited to maxTotalSize
+// characters. A point register follows the edits of its document while
+// that is open, like an Emacs marker.
+class Registers
+{
+public:
+  struct Register
+  {
+    enum Type { Empty, Text, Point, Number };
+    Register() : type(Empty), value(0) {}
+    Type type;
+    QString text; // the text, or the file of a point register
+    qint64 value; // the position of a point register, or the number
+    QTextCursor cursor; // where a point register is while its document lives
+  };
+
+  static const int maxTotalSize = 16 * 1024 * 1024;
+
+  static Registers* instance();
+  Register get(QChar name) const;
+  // Fails if the text would exceed the size limit.
+  bool setText(QChar name, const QString& text);
+  void setPoint(QChar name, const QString& fileName,
+                const QTextCursor& position);
+  void setNumber(QChar name, qint64 number);
+  bool load(const QString& fileName);
+  bool save(const QString& fileName) const;
+
+private:
+  Registers();
+  void set(QChar name, const Register& reg);
+  static Register follow(Register reg);
+
+  QHash<ushort, Register> registers;
+  int totalSize;
+};
+
+#endif
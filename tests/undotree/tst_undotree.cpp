@@ -0,0 +1,180 @@
+#include "undotree.h"
+
+#include <QtTest>
+#include <QTextCursor>
+#include <QTextDocument>
+
+class tst_UndoTree : public QObject
+{
+  Q_OBJECT
+
+private slots:
+  void amalgamate_data();
+  void amalgamate();
+  void runLimit();
+  void pointMovedEndsRun();
+  void otherChangeEndsRun();
+  void sharesDocumentHistory();
+  void mergeKeepsBranches();
+
+private:
+  // Types text like the handler does, the first character starts a
+  // change in an edit block of its own and the others amalgamate with it.
+  // editBlocks puts the others in edit blocks, too.
+  static void type(UndoTree* tree, QTextCursor* tc, const QString& text,
+                   bool editBlocks);
+};
+
+void tst_UndoTree::type(UndoTree* tree, QTextCursor* tc, const QString& text,
+                        bool editBlocks)
+{
+  for (int i = 0; i != text.size(); ++i) {
+    const bool startsRun = i == 0 || !tree->amalgamate(tc->position());
+    if (startsRun) {
+      tree->boundary(tc->position());
+    }
+    if (startsRun || editBlocks) {
+      tc->beginEditBlock();
+    }
+    tc->insertText(text.at(i));
+    if (startsRun || editBlocks) {
+      tc->endEditBlock();
+    }
+  }
+}
+
+void tst_UndoTree::amalgamate_data()
+{
+  QTest::addColumn<bool>("editBlocks");
+  QTest::newRow("plain inserts") << false;
+  QTest::newRow("undo step per character") << true;
+}
+
+void tst_UndoTree::amalgamate()
+{
+  QFETCH(bool, editBlocks);
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  type(tree, &tc, QLatin1String("abc"), editBlocks);
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("abc"));
+  QCOMPARE(tree->depth(), 1);
+
+  QCOMPARE(tree->undo(), 0);
+  QCOMPARE(document.toPlainText(), QString());
+  QCOMPARE(tree->undo(), -1);
+  QVERIFY(tree->redo() != -1);
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("abc"));
+}
+
+// Qt merges the plain inserts into one undo step, the tree still undoes
+// them maxRun at a time.
+void tst_UndoTree::runLimit()
+{
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  const QString text = QString(UndoTree::maxRun * 2 + 5, QLatin1Char('a'));
+  type(tree, &tc, text, false);
+  QCOMPARE(tree->depth(), 3);
+
+  tree->undo();
+  QCOMPARE(document.toPlainText().size(), UndoTree::maxRun * 2);
+  tree->undo();
+  QCOMPARE(document.toPlainText().size(), UndoTree::maxRun);
+  tree->undo();
+  QCOMPARE(document.toPlainText(), QString());
+}
+
+void tst_UndoTree::pointMovedEndsRun()
+{
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  type(tree, &tc, QLatin1String("ab"), true);
+  tc.setPosition(0);
+  QVERIFY(!tree->amalgamate(tc.position()));
+  type(tree, &tc, QLatin1String("x"), true);
+  QCOMPARE(tree->depth(), 2);
+
+  tree->undo();
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("ab"));
+}
+
+void tst_UndoTree::otherChangeEndsRun()
+{
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  type(tree, &tc, QLatin1String("ab"), true);
+  // like another editor of the same document
+  QTextCursor other(&document);
+  other.beginEditBlock();
+  other.insertText(QLatin1String("z"));
+  other.endEditBlock();
+  QCOMPARE(tree->depth(), 2);
+  QVERIFY(!tree->amalgamate(tc.position()));
+}
+
+void tst_UndoTree::sharesDocumentHistory()
+{
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  tree->boundary(0);
+  tc.insertText(QLatin1String("ab"));
+  document.setModified(false);
+  tree->boundary(tc.position());
+  tc.insertText(QLatin1String("\nx"));
+  QVERIFY(document.isModified());
+
+  // undoing in the tree undoes on the document's stack
+  tree->undo();
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("ab"));
+  QVERIFY(!document.isModified());
+  QVERIFY(document.isRedoAvailable());
+
+  // so does Ctrl+Z, and the tree follows
+  document.undo();
+  QCOMPARE(document.toPlainText(), QString());
+  QCOMPARE(tree->depth(), 0);
+  QVERIFY(tree->redo() != -1);
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("ab"));
+
+  // a new change keeps the undone one as a branch
+  type(tree, &tc, QLatin1String("c"), true);
+  tree->undo();
+  QCOMPARE(tree->branchCount(), 2);
+  QVERIFY(tree->selectBranch(-1));
+  QVERIFY(tree->redo() != -1);
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("ab\nx"));
+}
+
+// A plain insert right after an undo is merged by Qt into the step the
+// tree undid to, the branch undone from there stays.
+void tst_UndoTree::mergeKeepsBranches()
+{
+  QTextDocument document;
+  UndoTree* tree = UndoTree::forDocument(&document);
+  QTextCursor tc(&document);
+  tree->boundary(0);
+  tc.insertText(QLatin1String("foo"));
+  tree->boundary(tc.position());
+  tc.deletePreviousChar();
+  QCOMPARE(tree->depth(), 2);
+
+  tree->undo();
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("foo"));
+  tree->boundary(3);
+  tc.setPosition(3);
+  tc.insertText(QLatin1String("x"));
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("foox"));
+  QCOMPARE(tree->depth(), 1);
+  QCOMPARE(tree->branchCount(), 1);
+
+  QVERIFY(tree->redo() != -1);
+  QCOMPARE(document.toPlainText(), QString::fromLatin1("fox"));
+}
+
+QTEST_MAIN(tst_UndoTree)
+#include "tst_undotree.moc"
@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = tst_undotree
+
+QT += testlib
+CONFIG += qtestlib testcase
+
+INCLUDEPATH += ../..
+
+SOURCES += \
+    tst_undotree.cpp \
+    ../../undotree.cpp
+
+HEADERS += \
+    ../../undotree.h
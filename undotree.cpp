@@ -0,0 +1,607 @@
+#include "undotree.h"
+
+#include <QHash>
+#include <QSet>
+#include <QTextCursor>
+#include <QTextDocument>
+
+typedef QHash<QTextDocument*, UndoTree*> UndoTreeHash;
+Q_GLOBAL_STATIC(UndoTreeHash, trees)
+
+UndoTree::UndoTree(QTextDocument* document)
+  : QObject(document), textDocument(document), root(0), current(0),
+    savedNode(0), open(false), joinNext(false), applying(false),
+    recorded(false), commandAdded(false), pendingCursor(-1), changes(0),
+    runLength(0), lastEnd(-1), savedSteps(-1), undoSteps(0),
+    redoSteps(0), totalSize(0), sequence(0)
+{
+  reset();
+  connect(document, SIGNAL(contentsChange(int,int,int)),
+          SLOT(contentsChange(int,int,int)));
+  connect(document, SIGNAL(undoCommandAdded()), SLOT(undoCommandAdded()));
+  connect(document, SIGNAL(modificationChanged(bool)),
+          SLOT(modificationChanged(bool)));
+}
+
+UndoTree::~UndoTree()
+{
+  deleteTree(root);
+  // documents may outlive the hash at exit
+  if (UndoTreeHash* hash = trees()) {
+    hash->remove(textDocument);
+  }
+}
+
+UndoTree* UndoTree::forDocument(QTextDocument* document)
+{
+  UndoTree*& tree = (*trees())[document];
+  if (!tree) {
+    tree = new UndoTree(document);
+  }
+  return tree;
+}
+
+void UndoTree::deleteTree(Node* node)
+{
+  foreach (Node* child, node->children) {
+    deleteTree(child);
+  }
+  delete node;
+}
+
+// Forgets all changes and starts over from the document as it is.
+void UndoTree::reset()
+{
+  if (root) {
+    deleteTree(root);
+  }
+  root = current = new Node;
+  root->steps = textDocument->availableUndoSteps();
+  savedNode = textDocument->isModified() ? 0 : root;
+  savedSteps = -1;
+  open = false;
+  joinNext = false;
+  recorded = false;
+  pendingCursor = -1;
+  changes = 0;
+  totalSize = 0;
+  syncSteps();
+}
+
+void UndoTree::discard()
+{
+  const bool hadHistory = root != current || !root->children.isEmpty();
+  reset();
+  if (hadHistory) {
+    emit historyDiscarded();
+  }
+}
+
+// The document's stack changed behind the tree's back, like after
+// clearUndoRedoStacks().
+void UndoTree::checkSteps()
+{
+  if (textDocument->availableUndoSteps() != current->steps) {
+    discard();
+  }
+}
+
+void UndoTree::syncSteps()
+{
+  undoSteps = textDocument->availableUndoSteps();
+  redoSteps = textDocument->availableRedoSteps();
+  commandAdded = false;
+}
+
+// After the tree moved itself. A change made anew leaves the document
+// modified even where it was saved.
+void UndoTree::settle()
+{
+  open = false;
+  joinNext = false;
+  recorded = false;
+  if (savedNode && (current == savedNode) == textDocument->isModified()) {
+    textDocument->setModified(current != savedNode);
+  }
+  syncSteps();
+  prune();
+}
+
+void UndoTree::boundary(int cursor)
+{
+  open = false;
+  joinNext = false;
+  pendingCursor = cursor;
+  changes = 0;
+}
+
+// Changes from elsewhere, like another editor of the document, or point
+// having moved away from the last change end the run.
+bool UndoTree::amalgamate(int cursor)
+{
+  if (!recorded || current == root || changes != 1 || cursor != lastEnd
+      || runLength >= maxRun) {
+    return false;
+  }
+  open = true;
+  joinNext = true;
+  changes = 0;
+  ++runLength;
+  return true;
+}
+
+void UndoTree::contentsChange(int position, int charsRemoved, int charsAdded)
+{
+  if (applying) {
+    return;
+  }
+  // like Qt's own undo stack, loading a file without undo starts afresh
+  if (!textDocument->isUndoRedoEnabled()) {
+    discard();
+    return;
+  }
+  const int steps = textDocument->availableUndoSteps();
+  if (commandAdded && steps <= undoSteps) {
+    discard();
+  } else if (steps < undoSteps) {
+    undone(steps);
+  } else if (steps > undoSteps && !commandAdded) {
+    redone(steps);
+  } else {
+    record(position, charsRemoved, charsAdded, steps);
+  }
+  if (savedSteps != -1) {
+    if (current->steps == savedSteps) {
+      savedNode = current;
+    }
+    savedSteps = -1;
+  }
+  syncSteps();
+}
+
+void UndoTree::undoCommandAdded()
+{
+  if (!applying) {
+    commandAdded = true;
+    if (!joinNext) {
+      open = false;
+    }
+  }
+}
+
+void UndoTree::modificationChanged(bool changed)
+{
+  if (changed || applying) {
+    return;
+  }
+  // an undo reaching the saved text may tell before its contentsChange
+  savedSteps = textDocument->availableUndoSteps();
+  if (current->steps == savedSteps) {
+    savedNode = current;
+    savedSteps = -1;
+  }
+}
+
+UndoTree::Node* UndoTree::addChild(Node* parent)
+{
+  Node* node = new Node;
+  node->parent = parent;
+  node->sequence = ++sequence;
+  parent->children.append(node);
+  return node;
+}
+
+// Puts a node between node and its parent for the document's state after
+// steps undo steps, for when the document stopped inside a node. Neither
+// knows its span then.
+UndoTree::Node* UndoTree::split(Node* node, int steps)
+{
+  Node* parent = node->parent;
+  Node* middle = new Node;
+  middle->parent = parent;
+  middle->steps = steps;
+  middle->cursor = node->cursor;
+  middle->spanValid = false;
+  middle->sequence = ++sequence;
+  middle->children.append(node);
+  middle->redo = node;
+  parent->children[parent->children.indexOf(node)] = middle;
+  if (parent->redo == node) {
+    parent->redo = middle;
+  }
+  release(node);
+  node->parent = middle;
+  node->cursor = -1;
+  node->spanValid = false;
+  return middle;
+}
+
+// For undo steps the document had before the tree was made.
+void UndoTree::extendRoot(int steps)
+{
+  Node* node = new Node;
+  node->steps = steps;
+  node->children.append(root);
+  node->redo = root;
+  root->parent = node;
+  root->spanValid = false;
+  root = node;
+}
+
+// Like in WordIndex a change only says which span of the text it
+// replaced, the span of a node grows to cover all of its changes.
+void UndoTree::record(int position, int charsRemoved, int charsAdded,
+                      int steps)
+{
+  dropRedo(current);
+  // Qt merges typing into its last undo step, that cannot be split
+  const bool merged = steps == current->steps;
+  if (merged && current == root) {
+    return;
+  }
+  if (merged) {
+    // the branches undone from current keep their change and stay, only
+    // moved past this one
+    for (int i = current->children.size() - 1; i >= 0; --i) {
+      Node* child = current->children.at(i);
+      if (child->captured) {
+        shift(child, position, charsRemoved, charsAdded);
+      } else {
+        removeSubtree(child);
+      }
+    }
+  } else if (!open) {
+    Node* node = addChild(current);
+    node->cursor = pendingCursor == -1 ? position : pendingCursor;
+    node->start = node->end = position;
+    current->active = current->children.size() - 1;
+    current = node;
+    pendingCursor = -1;
+    runLength = 1;
+  }
+  // only the change of the amalgamated command itself joins
+  open = true;
+  joinNext = false;
+  recorded = true;
+  ++changes;
+  lastEnd = position + charsAdded;
+  current->steps = steps;
+  if (current->spanValid) {
+    current->start = qMin(current->start, position);
+    current->end = qMax(current->end, position + charsRemoved)
+        + charsAdded - charsRemoved;
+    current->delta += charsAdded - charsRemoved;
+  }
+}
+
+// The document undid changes by itself, like with Ctrl+Z.
+void UndoTree::undone(int steps)
+{
+  while (current->steps > steps) {
+    if (current == root) {
+      extendRoot(steps);
+    }
+    Node* node = current;
+    Node* parent = node->parent->steps < steps
+        ? split(node, steps) : node->parent;
+    parent->redo = node;
+    parent->active = parent->children.indexOf(node);
+    current = parent;
+  }
+  open = false;
+  joinNext = false;
+  recorded = false;
+}
+
+void UndoTree::redone(int steps)
+{
+  while (current->steps < steps) {
+    Node* node = current->redo;
+    if (!node) {
+      node = addChild(current);
+      node->steps = steps;
+      node->spanValid = false;
+    } else if (node->steps > steps) {
+      node = split(node, steps);
+    }
+    release(node);
+    current->redo = 0;
+    current->active = current->children.indexOf(node);
+    current = node;
+  }
+  open = false;
+  joinNext = false;
+  recorded = false;
+}
+
+// The document dropped its redo steps. Nodes on them that did not keep
+// their change cannot be redone anymore.
+void UndoTree::dropRedo(Node* node)
+{
+  Node* next = node->redo;
+  node->redo = 0;
+  while (next) {
+    Node* child = next;
+    next = child->redo;
+    child->redo = 0;
+    if (!child->captured) {
+      removeSubtree(child);
+      break;
+    }
+  }
+}
+
+// Moves the kept changes of the branch at node past a change made in the
+// state it starts from. A kept change the new one overlaps stays put.
+void UndoTree::shift(Node* node, int position, int charsRemoved,
+                     int charsAdded)
+{
+  const int delta = charsAdded - charsRemoved;
+  QList<Node*> nodes;
+  nodes.append(node);
+  while (!nodes.isEmpty()) {
+    Node* next = nodes.takeLast();
+    if (next->captured && next->position >= position + charsRemoved) {
+      next->position += delta;
+    }
+    if (next->spanValid && next->start >= position + charsRemoved) {
+      next->start += delta;
+      next->end += delta;
+    }
+    nodes += next->children;
+  }
+}
+
+void UndoTree::removeSubtree(Node* node)
+{
+  Node* parent = node->parent;
+  const int index = parent->children.indexOf(node);
+  parent->children.removeAt(index);
+  if (parent->active > index || parent->active == parent->children.size()) {
+    parent->active = qMax(0, parent->active - 1);
+  }
+  if (parent->redo == node) {
+    parent->redo = 0;
+  }
+  QList<Node*> nodes;
+  nodes.append(node);
+  while (!nodes.isEmpty()) {
+    Node* next = nodes.takeLast();
+    release(next);
+    if (next == savedNode) {
+      savedNode = 0;
+    }
+    nodes += next->children;
+  }
+  deleteTree(node);
+}
+
+void UndoTree::capture(Node* node, int position, const QString& removed,
+                       const QString& added)
+{
+  release(node);
+  int prefix = 0;
+  const int common = qMin(removed.size(), added.size());
+  while (prefix != common && removed.at(prefix) == added.at(prefix)) {
+    ++prefix;
+  }
+  int suffix = 0;
+  while (suffix != common - prefix
+         && removed.at(removed.size() - 1 - suffix)
+            == added.at(added.size() - 1 - suffix)) {
+    ++suffix;
+  }
+  node->position = position + prefix;
+  node->removed = removed.mid(prefix, removed.size() - prefix - suffix);
+  node->added = added.mid(prefix, added.size() - prefix - suffix);
+  node->captured = true;
+  node->sequence = ++sequence;
+  totalSize += node->removed.size() + node->added.size();
+}
+
+void UndoTree::release(Node* node)
+{
+  if (node->captured) {
+    totalSize -= node->removed.size() + node->added.size();
+    node->removed.clear();
+    node->added.clear();
+    node->captured = false;
+  }
+}
+
+// Keeps the kept changes below maxSize. The oldest branches off the
+// document's stack go first, the nodes on its redo steps only lose the
+// chance to come back after the document dropped them. Nothing the
+// document can still undo is touched.
+void UndoTree::prune()
+{
+  if (totalSize <= maxSize) {
+    return;
+  }
+  QSet<Node*> live;
+  for (Node* node = current; node; node = node->parent) {
+    live.insert(node);
+  }
+  for (Node* node = current->redo; node; node = node->redo) {
+    live.insert(node);
+  }
+  while (totalSize > maxSize) {
+    Node* oldest = 0;
+    foreach (Node* node, live) {
+      foreach (Node* child, node->children) {
+        if (!live.contains(child)
+            && (!oldest || child->sequence < oldest->sequence)) {
+          oldest = child;
+        }
+      }
+    }
+    if (!oldest) {
+      break;
+    }
+    removeSubtree(oldest);
+  }
+  for (Node* node = current->redo; node && totalSize > maxSize;
+       node = node->redo) {
+    release(node);
+  }
+}
+
+QString UndoTree::text(int from, int to) const
+{
+  const int last = textDocument->characterCount() - 1;
+  QTextCursor tc(textDocument);
+  tc.setPosition(qBound(0, from, last));
+  tc.setPosition(qBound(0, to, last), QTextCursor::KeepAnchor);
+  return tc.selectedText().replace(QChar::ParagraphSeparator,
+                                   QLatin1Char('\n'));
+}
+
+int UndoTree::undo()
+{
+  if (!textDocument->isUndoRedoEnabled()) {
+    return -1;
+  }
+  checkSteps();
+  QTextCursor tc(textDocument);
+  if (current == root) {
+    // changes from before the tree are undone one by one
+    if (textDocument->availableUndoSteps() == 0) {
+      return -1;
+    }
+    applying = true;
+    textDocument->undo(&tc);
+    applying = false;
+    extendRoot(textDocument->availableUndoSteps());
+    current = root;
+    settle();
+    return tc.position();
+  }
+
+  // the text of the span before and after is what redoing the node off
+  // the document's stack needs
+  Node* node = current;
+  Node* parent = node->parent;
+  const int start = node->spanValid ? node->start : 0;
+  const QString added = text(start, node->spanValid
+                                    ? node->end
+                                    : textDocument->characterCount() - 1);
+  applying = true;
+  while (textDocument->availableUndoSteps() > parent->steps) {
+    const int steps = textDocument->availableUndoSteps();
+    textDocument->undo(&tc);
+    if (textDocument->availableUndoSteps() == steps) {
+      break;
+    }
+  }
+  applying = false;
+  const QString removed = text(start, node->spanValid
+                                      ? node->end - node->delta
+                                      : textDocument->characterCount() - 1);
+  capture(node, start, removed, added);
+
+  parent->redo = node;
+  parent->active = parent->children.indexOf(node);
+  current = parent;
+  settle();
+  const int cursor = node->cursor == -1 ? tc.position() : node->cursor;
+  return qMin(cursor, textDocument->characterCount() - 1);
+}
+
+int UndoTree::redo()
+{
+  if (!textDocument->isUndoRedoEnabled()) {
+    return -1;
+  }
+  checkSteps();
+  QTextCursor tc(textDocument);
+  if (current->children.isEmpty()) {
+    // so are redo steps the tree does not know about
+    if (textDocument->availableRedoSteps() == 0) {
+      return -1;
+    }
+    applying = true;
+    textDocument->redo(&tc);
+    applying = false;
+    Node* node = addChild(current);
+    node->steps = textDocument->availableUndoSteps();
+    node->spanValid = false;
+    current->active = current->children.size() - 1;
+    current = node;
+    settle();
+    return tc.position();
+  }
+
+  Node* node = current->children.at(current->active);
+  if (node != current->redo && !node->captured) {
+    return -1;
+  }
+  applying = true;
+  if (node == current->redo) {
+    while (textDocument->availableUndoSteps() < node->steps) {
+      const int steps = textDocument->availableUndoSteps();
+      textDocument->redo(&tc);
+      if (textDocument->availableUndoSteps() == steps) {
+        break;
+      }
+    }
+  } else {
+    // a branch the document no longer has, its change is made anew
+    dropRedo(current);
+    if (!node->removed.isEmpty() || !node->added.isEmpty()) {
+      tc.beginEditBlock();
+      tc.setPosition(node->position);
+      tc.setPosition(node->position + node->removed.size(),
+                     QTextCursor::KeepAnchor);
+      tc.insertText(node->added);
+      tc.endEditBlock();
+    }
+    node->steps = textDocument->availableUndoSteps();
+    node->redo = 0;
+  }
+  applying = false;
+  current->redo = 0;
+  release(node);
+  current = node;
+  settle();
+  // point goes after the last change, like after doing it the first time
+  return tc.position();
+}
+
+bool UndoTree::selectBranch(int step)
+{
+  const int n = current->children.size();
+  if (n < 2) {
+    return false;
+  }
+  current->active = ((current->active + step) % n + n) % n;
+  return true;
+}
+
+int UndoTree::depth() const
+{
+  int n = 0;
+  for (const Node* node = current; node != root; node = node->parent) {
+    ++n;
+  }
+  return n;
+}
+
+int UndoTree::redoDepth() const
+{
+  int n = 0;
+  for (const Node* node = current; !node->children.isEmpty();
+       node = node->children.at(node->active)) {
+    ++n;
+  }
+  return n;
+}
+
+int UndoTree::branch() const
+{
+  return current->active;
+}
+
+int UndoTree::branchCount() const
+{
+  return current->children.size();
+}
@@ -0,0 +1,128 @@
+#ifndef UNDOTREE_H
+#define UNDOTREE_H
+
+#include <QList>
+#include <QObject>
+#include <QString>
+
+class QTextDocument;
+
+// The changes of a document as a tree, like Emacs' undo-tree, laid over
+// the document's own undo stack. Every node stands for the undo steps of
+// the document that lead to it from its parent. Moving along the branch
+// the document's stack holds undoes and redoes on that stack, so Ctrl+Z,
+// C-/ and the modified state all see the same history.
+//
+// A node only records the span of the text it changed. When the tree
+// undoes it, the text of the span before and after is kept, so the node
+// can still be redone after a new change made the document drop its redo
+// steps. That text is limited to maxSize characters for all nodes, beyond
+// that the oldest branches off the document's stack are forgotten.
+class UndoTree : public QObject
+{
+  Q_OBJECT
+
+public:
+  static const int maxSize = 4 * 1024 * 1024;
+  static const int maxRun = 20;
+
+  static UndoTree* forDocument(QTextDocument* document);
+
+  // Starts a new node with the next change. cursor is where point is
+  // restored to when the node is undone.
+  void boundary(int cursor);
+  // Makes the next changes part of the last node instead, if that holds
+  // the one change since the last call, ending at cursor, and was not
+  // undone or redone since. A node takes at most maxRun changes this way.
+  // Qt merges plain typing into the document's last undo step, so the
+  // change after a boundary() needs its own edit block to start a node
+  // that can be undone by itself.
+  bool amalgamate(int cursor);
+  // Both return the position of point afterwards, or -1 if there is
+  // nothing to undo or redo.
+  int undo();
+  int redo();
+  // Chooses the branch that redo follows from the current node.
+  bool selectBranch(int step);
+  int depth() const;
+  int redoDepth() const;
+  int branch() const;
+  int branchCount() const;
+
+signals:
+  // The history was dropped, like when a file is loaded without undo.
+  void historyDiscarded();
+
+private slots:
+  void contentsChange(int position, int charsRemoved, int charsAdded);
+  void undoCommandAdded();
+  void modificationChanged(bool changed);
+
+private:
+  struct Node
+  {
+    Node()
+      : parent(0), active(0), redo(0), steps(0), cursor(-1), start(0),
+        end(0), delta(0), spanValid(true), captured(false), position(0),
+        sequence(0) {}
+    Node* parent;
+    QList<Node*> children;
+    int active; // the child redo goes to
+    Node* redo; // the child the document's redo stack holds
+    int steps; // undo steps of the document up to this node
+    int cursor; // point before the node's changes
+    int start; // the span the node changed, after the change
+    int end;
+    int delta; // how much longer the node made the text
+    bool spanValid;
+    bool captured; // removed and added hold the node's change
+    int position;
+    QString removed;
+    QString added;
+    int sequence; // age, for pruning
+  };
+
+  UndoTree(QTextDocument* document);
+  ~UndoTree();
+  void reset();
+  void discard();
+  void checkSteps();
+  void syncSteps();
+  void settle();
+  void record(int position, int charsRemoved, int charsAdded, int steps);
+  void undone(int steps);
+  void redone(int steps);
+  Node* addChild(Node* parent);
+  Node* split(Node* node, int steps);
+  void extendRoot(int steps);
+  void dropRedo(Node* node);
+  void shift(Node* node, int position, int charsRemoved, int charsAdded);
+  void removeSubtree(Node* node);
+  void capture(Node* node, int position, const QString& removed,
+               const QString& added);
+  void release(Node* node);
+  void prune();
+  QString text(int from, int to) const;
+  static void deleteTree(Node* node);
+
+  QTextDocument* textDocument;
+  Node* root;
+  Node* current;
+  Node* savedNode; // where the document was last unmodified
+  bool open; // the next change continues current
+  bool joinNext; // so do new undo steps of the document, for amalgamate()
+  bool applying;
+  bool recorded; // current was made by the last change
+  bool commandAdded; // the document started an undo step
+  int pendingCursor;
+  int changes; // since the last boundary() or amalgamate()
+  int runLength; // changes amalgamated into current
+  int lastEnd; // where the last change ended
+  int savedSteps; // unmodified at these steps, before the change is seen
+  int undoSteps; // the document's undo and redo steps after the last change
+  int redoSteps;
+  int totalSize;
+  int sequence;
+};
+
+#endif
@@ -0,0 +1,263 @@
+#include "wordindex.h"
+
+#include <QHash>
+#include <QSet>
+#include <QTextBlock>
+#include <QTextDocument>
+
+typedef QHash<QTextDocument*, WordIndex*> WordIndexHash;
+Q_GLOBAL_STATIC(WordIndexHash, indexes)
+
+// Words with their column, in the order they appear in text.
+static void tokenize(const QString& text, QStringList* words,
+                     QList<int>* columns = 0)
+{
+  const int n = text.size();
+  int i = 0;
+  while (i != n) {
+    while (i != n && !WordIndex::isWordCharacter(text.at(i))) {
+      ++i;
+    }
+    const int start = i;
+    while (i != n && WordIndex::isWordCharacter(text.at(i))) {
+      ++i;
+    }
+    // a single character is no use as an expansion
+    if (i - start > 1) {
+      words->append(text.mid(start, i - start));
+      if (columns) {
+        columns->append(start);
+      }
+    }
+  }
+}
+
+WordIndex::WordIndex(QTextDocument* document)
+  : QObject(document), textDocument(document), indexed(0)
+{
+  stepTimer.setSingleShot(true);
+  connect(&stepTimer, SIGNAL(timeout()), SLOT(indexStep()));
+  rebuild();
+  connect(document, SIGNAL(contentsChange(int,int,int)),
+          SLOT(contentsChange(int,int,int)));
+}
+
+WordIndex::~WordIndex()
+{
+  // documents may outlive the hash at exit
+  if (WordIndexHash* hash = indexes()) {
+    hash->remove(textDocument);
+  }
+}
+
+WordIndex* WordIndex::forDocument(QTextDocument* document)
+{
+  WordIndex*& index = (*indexes())[document];
+  if (!index) {
+    index = new WordIndex(document);
+  }
+  return index;
+}
+
+bool WordIndex::isWordCharacter(QChar c)
+{
+  return c.isLetterOrNumber() || c == QLatin1Char('_');
+}
+
+QTextDocument* WordIndex::document() const
+{
+  return textDocument;
+}
+
+// Starts indexing the document over.
+void WordIndex::rebuild()
+{
+  counts.clear();
+  blockWords.clear();
+  blockWords.resize(textDocument->blockCount());
+  indexed = 0;
+  stepTimer.start(0);
+}
+
+void WordIndex::indexStep()
+{
+  if (indexed >= blockWords.size()) {
+    return;
+  }
+  QTextBlock block = textDocument->findBlockByNumber(indexed);
+  const int end = qMin(indexed + blocksPerStep, blockWords.size());
+  for (; indexed != end && block.isValid(); ++indexed, block = block.next()) {
+    tokenize(block.text(), &blockWords[indexed]);
+    addWords(blockWords[indexed]);
+  }
+  if (indexed != blockWords.size()) {
+    stepTimer.start(0);
+  }
+}
+
+QStringList WordIndex::wordsOf(const QTextBlock& block) const
+{
+  const int number = block.blockNumber();
+  if (number < indexed) {
+    return blockWords.at(number);
+  }
+  QStringList words;
+  tokenize(block.text(), &words);
+  return words;
+}
+
+// Counts the words and makes them share the string of the count's key,
+// so a word that occurs a thousand times is stored once.
+void WordIndex::addWords(QStringList& words)
+{
+  for (int i = 0; i != words.size(); ++i) {
+    QMap<QString, int>::iterator it = counts.find(words.at(i));
+    if (it == counts.end()) {
+      it = counts.insert(words.at(i), 0);
+    }
+    ++it.value();
+    words[i] = it.key();
+  }
+}
+
+void WordIndex::removeWords(const QStringList& words)
+{
+  foreach (const QString& word, words) {
+    QMap<QString, int>::iterator it = counts.find(word);
+    if (it != counts.end() && --it.value() == 0) {
+      counts.erase(it);
+    }
+  }
+}
+
+// An edit replaces a run of blocks by another one. The new run is found
+// from the position and the number of characters added, the old one from
+// the change in the number of blocks. The new blocks are indexed if the
+// old ones were partly, those after them are left to indexStep().
+void WordIndex::contentsChange(int position, int charsRemoved, int charsAdded)
+{
+  Q_UNUSED(charsRemoved);
+  QTextBlock firstBlock = textDocument->findBlock(position);
+  QTextBlock lastBlock = textDocument->findBlock(position + charsAdded);
+  if (!firstBlock.isValid()) {
+    firstBlock = textDocument->lastBlock();
+  }
+  if (!lastBlock.isValid()) {
+    lastBlock = textDocument->lastBlock();
+  }
+  const int first = firstBlock.blockNumber();
+  const int last = lastBlock.blockNumber();
+  const int oldLast = last - (textDocument->blockCount() - blockWords.size());
+  if (oldLast < first - 1 || oldLast >= blockWords.size()) {
+    rebuild();
+    return;
+  }
+
+  for (int i = first; i <= oldLast; ++i) {
+    removeWords(blockWords.at(i));
+  }
+  blockWords.remove(first, oldLast - first + 1);
+  blockWords.insert(first, last - first + 1, QStringList());
+  if (first >= indexed) {
+    return;
+  }
+  indexed = oldLast < indexed ? indexed + last - oldLast : last + 1;
+  QTextBlock block = firstBlock;
+  for (int i = first; i <= last; ++i, block = block.next()) {
+    tokenize(block.text(), &blockWords[i]);
+    addWords(blockWords[i]);
+  }
+}
+
+int WordIndex::countWithPrefix(const QString& prefix) const
+{
+  int n = 0;
+  QMap<QString, int>::const_iterator it = counts.lowerBound(prefix);
+  for (; it != counts.constEnd() && it.key().startsWith(prefix); ++it) {
+    if (it.key().size() > prefix.size()) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+QStringList WordIndex::wordsWithPrefix(const QString& prefix) const
+{
+  QMultiMap<int, QString> byCount;
+  QMap<QString, int>::const_iterator it = counts.lowerBound(prefix);
+  for (; it != counts.constEnd() && it.key().startsWith(prefix); ++it) {
+    if (it.key().size() > prefix.size()) {
+      byCount.insert(-it.value(), it.key());
+    }
+  }
+  return byCount.values();
+}
+
+QStringList WordIndex::expansions(const QString& prefix, int blockNumber,
+                                  int column) const
+{
+  QStringList result;
+  // stop walking the blocks as soon as every candidate was seen, which
+  // is only known once all are indexed
+  const bool complete = indexed == blockWords.size();
+  const int total = complete ? countWithPrefix(prefix) : -1;
+  if (total == 0) {
+    return result;
+  }
+  QSet<QString> seen;
+  const int size = prefix.size();
+
+  // the block with point is tokenized again for the columns
+  QStringList words;
+  QList<int> columns;
+  const QTextBlock current = textDocument->findBlockByNumber(blockNumber);
+  tokenize(current.text(), &words, &columns);
+  QStringList after;
+  for (int i = words.size() - 1; i >= 0; --i) {
+    const QString& word = words.at(i);
+    if (columns.at(i) <= column && column <= columns.at(i) + word.size()) {
+      continue;
+    }
+    if (word.size() <= size || !word.startsWith(prefix)) {
+      continue;
+    }
+    if (columns.at(i) > column) {
+      after.prepend(word);
+    } else if (!seen.contains(word)) {
+      seen.insert(word);
+      result.append(word);
+    }
+  }
+
+  for (QTextBlock block = current.previous();
+       block.isValid() && result.size() != total; block = block.previous()) {
+    const QStringList words = wordsOf(block);
+    for (int j = words.size() - 1; j >= 0; --j) {
+      const QString& word = words.at(j);
+      if (word.size() > size && word.startsWith(prefix)
+          && !seen.contains(word)) {
+        seen.insert(word);
+        result.append(word);
+      }
+    }
+  }
+
+  foreach (const QString& word, after) {
+    if (!seen.contains(word)) {
+      seen.insert(word);
+      result.append(word);
+    }
+  }
+
+  for (QTextBlock block = current.next();
+       block.isValid() && result.size() != total; block = block.next()) {
+    foreach (const QString& word, wordsOf(block)) {
+      if (word.size() > size && word.startsWith(prefix)
+          && !seen.contains(word)) {
+        seen.insert(word);
+        result.append(word);
+      }
+    }
+  }
+  return result;
+}
@@ -0,0 +1,62 @@
+#ifndef WORDINDEX_H
+#define WORDINDEX_H
+
+#include <QList>
+#include <QMap>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+
+class QTextBlock;
+class QTextDocument;
+
+// The words of a document, for dabbrev-expand. The words of every block
+// are kept in order, together with how often each word occurs. Edits
+// only retokenize the blocks they touch, so the index stays current
+// without ever scanning the whole document again.
+//
+// The document is first indexed in steps of blocksPerStep blocks from
+// the event loop, so opening a large document does not stall. Until that
+// is done, the blocks not indexed yet are read directly by expansions()
+// and are missing from wordsWithPrefix().
+class WordIndex : public QObject
+{
+  Q_OBJECT
+
+public:
+  static const int blocksPerStep = 2000;
+
+  static WordIndex* forDocument(QTextDocument* document);
+  static bool isWordCharacter(QChar c);
+
+  QTextDocument* document() const;
+  // Words longer than prefix that start with it, the nearest ones before
+  // the column first, then the nearest ones after it. The word at the
+  // column itself is left out.
+  QStringList expansions(const QString& prefix, int blockNumber,
+                         int column) const;
+  // Words longer than prefix that start with it, most frequent first.
+  QStringList wordsWithPrefix(const QString& prefix) const;
+
+private slots:
+  void contentsChange(int position, int charsRemoved, int charsAdded);
+  void indexStep();
+
+private:
+  WordIndex(QTextDocument* document);
+  ~WordIndex();
+  void rebuild();
+  QStringList wordsOf(const QTextBlock& block) const;
+  void addWords(QStringList& words);
+  void removeWords(const QStringList& words);
+  int countWithPrefix(const QString& prefix) const;
+
+  QTextDocument* textDocument;
+  QVector<QStringList> blockWords; // empty from indexed on
+  int indexed; // the blocks before this one are indexed
+  QTimer stepTimer;
+  QMap<QString, int> counts;
+};
+
+#endif